@@ -0,0 +1,124 @@
+#pragma once
+#include <cstdint>
+#include <cerrno>
+#include <cstdlib>
+#include <new>
+
+// Counts every heap allocation of the program, compile with -DALLOC_TRACKING=1 to include it from benchmark.h.
+// Replaces the global operator new and glibc's malloc/calloc/realloc, so it must only be included once per program.
+// operator new goes straight to __libc_malloc, so the two counters never count the same allocation twice.
+// Aligned allocations are counted too: the std::align_val_t operator new overloads as news,
+// aligned_alloc, posix_memalign, memalign, valloc and pvalloc as mallocs.
+struct AllocationCounts {
+    uint64_t news; // operator new and new[]
+    uint64_t mallocs; // malloc, calloc and realloc
+    uint64_t bytes;
+};
+AllocationCounts allocationCounts = {0, 0, 0};
+
+AllocationCounts allocationsSince(AllocationCounts before) {
+    return {
+        allocationCounts.news - before.news,
+        allocationCounts.mallocs - before.mallocs,
+        allocationCounts.bytes - before.bytes
+    };
+}
+
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void __libc_free(void* ptr);
+void* __libc_memalign(size_t alignment, size_t size);
+void* __libc_valloc(size_t size);
+void* __libc_pvalloc(size_t size);
+
+void* malloc(size_t size) {
+    allocationCounts.mallocs++;
+    allocationCounts.bytes += size;
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) {
+    allocationCounts.mallocs++;
+    allocationCounts.bytes += count * size;
+    return __libc_calloc(count, size);
+}
+
+void* realloc(void* ptr, size_t size) {
+    allocationCounts.mallocs++;
+    allocationCounts.bytes += size;
+    return __libc_realloc(ptr, size);
+}
+
+void* memalign(size_t alignment, size_t size) {
+    allocationCounts.mallocs++;
+    allocationCounts.bytes += size;
+    return __libc_memalign(alignment, size);
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+int posix_memalign(void** ptr, size_t alignment, size_t size) {
+    // the checks posix_memalign makes before allocating
+    if (alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0 || alignment == 0) return EINVAL;
+    void* allocated = memalign(alignment, size);
+    if (allocated == nullptr) return ENOMEM;
+    *ptr = allocated;
+    return 0;
+}
+
+void* valloc(size_t size) {
+    allocationCounts.mallocs++;
+    allocationCounts.bytes += size;
+    return __libc_valloc(size);
+}
+
+void* pvalloc(size_t size) {
+    allocationCounts.mallocs++;
+    allocationCounts.bytes += size;
+    return __libc_pvalloc(size);
+}
+}
+
+void* trackedNew(size_t size) {
+    allocationCounts.news++;
+    allocationCounts.bytes += size;
+    void* ptr = __libc_malloc(size == 0 ? 1 : size);
+    if (ptr == nullptr) throw std::bad_alloc();
+    return ptr;
+}
+
+void* operator new(size_t size) { return trackedNew(size); }
+void* operator new[](size_t size) { return trackedNew(size); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    allocationCounts.news++;
+    allocationCounts.bytes += size;
+    return __libc_malloc(size == 0 ? 1 : size);
+}
+void* operator new[](size_t size, const std::nothrow_t& tag) noexcept { return operator new(size, tag); }
+void operator delete(void* ptr) noexcept { __libc_free(ptr); }
+void operator delete[](void* ptr) noexcept { __libc_free(ptr); }
+void operator delete(void* ptr, size_t) noexcept { __libc_free(ptr); }
+void operator delete[](void* ptr, size_t) noexcept { __libc_free(ptr); }
+
+void* trackedAlignedNew(size_t size, std::align_val_t alignment) {
+    allocationCounts.news++;
+    allocationCounts.bytes += size;
+    return __libc_memalign((size_t) alignment, size == 0 ? 1 : size);
+}
+
+void* operator new(size_t size, std::align_val_t alignment) {
+    void* ptr = trackedAlignedNew(size, alignment);
+    if (ptr == nullptr) throw std::bad_alloc();
+    return ptr;
+}
+void* operator new[](size_t size, std::align_val_t alignment) { return operator new(size, alignment); }
+void* operator new(size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept { return trackedAlignedNew(size, alignment); }
+void* operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept { return trackedAlignedNew(size, alignment); }
+void operator delete(void* ptr, std::align_val_t) noexcept { __libc_free(ptr); }
+void operator delete[](void* ptr, std::align_val_t) noexcept { __libc_free(ptr); }
+void operator delete(void* ptr, size_t, std::align_val_t) noexcept { __libc_free(ptr); }
+void operator delete[](void* ptr, size_t, std::align_val_t) noexcept { __libc_free(ptr); }
@@ -7,8 +7,18 @@
 #include <chrono>
 #include <cstdlib>
 #include <cstdio>
+#include <cmath>
+#include <algorithm>
+#include <functional>
+#if ALLOC_TRACKING
+#include "alloc-tracker.h"
+#endif
 #include "doc.h"
+#include "md5.h"
+#include "perf-counters.h"
 #include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
 
 
 struct Config {
@@ -18,9 +28,45 @@ struct Config {
     std::string program = "";
     std::string out = "";
     bool viewCost = false;
+    size_t warmup = 0;
+    size_t iterations = 1;
+    std::string format = "sexp"; // sexp, json or csv
+    bool generate = false; // use the built in generators instead of the files in $BENCHDATA
+    uint64_t seed = 42;
+    // sweep mode, each is a list like "1,2,4", "10:100:10" or "1:1024:x2"
+    std::string sweepSizes = "";
+    std::string sweepPageWidths = "";
+    std::string sweepComputationWidths = "";
+    std::string sweepOut = "-";
+    std::string profileOut = ""; // per document profile, graphviz when it ends in .dot, json otherwise
+    bool perf = false; // hardware counters around the timed prints
+    std::string traceOut = ""; // chrome trace of the engine, needs -DTRACE_EVENTS=1
+    double traceThresholdUs = 100; // resolveCached misses and processConcat calls faster than this are not traced
+    size_t traceCapacity = 1 << 20; // events kept in the ring buffer
+    std::string resolveLog = ""; // log of the first timed print's resolve requests, needs -DRESOLVE_LOG=1
+    bool dagStats = false; // report the shape of the document before printing it
+    bool greedy = false; // also print with the greedy engine and report its cost next to the optimal one
+    size_t streamChunk = 0; // top level items per chunk for programs that can stream, 0 prints the whole document at once
+    bool reserve = true; // presize the engine from the input size before building the document
+    std::vector<std::string> positional; // arguments that are neither options nor their values
 };
 
 
+// Time the front end spends before print, in seconds. build reports parse itself when it reads or generates input,
+// benchmarkMain attributes the rest of build to constructing the document.
+struct FrontEndPhases {
+    double parse = 0;
+    double build = 0;
+};
+FrontEndPhases frontEndPhases;
+#if ALLOC_TRACKING
+AllocationCounts buildAllocations = {0, 0, 0}; // made while build() constructed the document
+#endif
+
+double secondsSince(std::chrono::steady_clock::time_point start) {
+    return secondsBetween(start, std::chrono::steady_clock::now());
+}
+
 // Split string by delimiter
 std::vector<std::string> split(const std::string& str, char delimiter) {
     std::stringstream ss(str);
@@ -32,25 +78,28 @@ std::vector<std::string> split(const std::string& str, char delimiter) {
     return elems;
 }
 
-// Simple MD5 hash using system command
+// MD5 of the layout, computed in process so hashing stays cheap compared to formatting
 std::string md5Hash(const std::string& input) {
-    const std::string filename = "tmpFile.txt";
-    std::ofstream outFile(filename);
-    outFile << input;
-    outFile.close();
+    Md5 md5;
+    md5.update(input);
+    return md5.hexDigest();
+}
 
-    std::string result;
-    FILE* pipe = popen(("md5sum " + filename).c_str(), "r");
-    if (!pipe) return "error";
-    char buffer[128];
-    if (fgets(buffer, 128, pipe)) {
-        result = buffer;
-    }
-    pclose(pipe);
-    std::remove(filename.c_str());
+// Path of a benchmark input file, relative to $BENCHDATA (defaults to ../data)
+std::string benchDataPath(const std::string& name) {
+    const char* envPath = std::getenv("BENCHDATA");
+    std::string basePath = envPath != nullptr ? envPath : "../data";
+    return basePath + "/" + name;
+}
 
-    auto parts = split(result, ' ');
-    return parts.empty() ? "error" : parts[0];
+std::ifstream openBenchData(const std::string& name) {
+    std::string path = benchDataPath(name);
+    std::ifstream file(path);
+    if (!file) {
+        std::cerr << "Failed to open " << path << ", set BENCHDATA or pass --generate to use generated input" << std::endl;
+        std::exit(1);
+    }
+    return file;
 }
 
 // Argument parser
@@ -69,20 +118,356 @@ Config parseArgs(int argc, char* argv[]) {
         else if (arg == "--program") cfg.program = nextArg();
         else if (arg == "--out") cfg.out = nextArg();
         else if (arg == "--view-cost") cfg.viewCost = true;
-        else {
+        else if (arg == "--warmup") cfg.warmup = std::stoul(nextArg());
+        else if (arg == "--iterations") cfg.iterations = std::max<size_t>(1, std::stoul(nextArg()));
+        else if (arg == "--format") cfg.format = nextArg();
+        else if (arg == "--generate") cfg.generate = true;
+        else if (arg == "--seed") cfg.seed = std::stoull(nextArg());
+        else if (arg == "--sweep-size") cfg.sweepSizes = nextArg();
+        else if (arg == "--sweep-page-width") cfg.sweepPageWidths = nextArg();
+        else if (arg == "--sweep-computation-width") cfg.sweepComputationWidths = nextArg();
+        else if (arg == "--sweep-out") cfg.sweepOut = nextArg();
+        else if (arg == "--profile-out") cfg.profileOut = nextArg();
+        else if (arg == "--perf") cfg.perf = true;
+        else if (arg == "--trace-out") cfg.traceOut = nextArg();
+        else if (arg == "--trace-threshold-us") cfg.traceThresholdUs = std::stod(nextArg());
+        else if (arg == "--trace-capacity") cfg.traceCapacity = std::stoul(nextArg());
+        else if (arg == "--resolve-log") cfg.resolveLog = nextArg();
+        else if (arg == "--dag-stats") cfg.dagStats = true;
+        else if (arg == "--greedy") cfg.greedy = true;
+        else if (arg == "--stream-chunk") cfg.streamChunk = std::stoul(nextArg());
+        else if (arg == "--no-reserve") cfg.reserve = false;
+        else if (arg.rfind("--", 0) != 0) cfg.positional.push_back(arg);
+    }
+    return cfg;
+}
+
+struct TimingStats {
+    double mean = 0;
+    double median = 0;
+    double p95 = 0;
+    double stddev = 0;
+    double min = 0;
+    double max = 0;
+};
+
+TimingStats computeStats(std::vector<double> samples) {
+    TimingStats stats;
+    if (samples.empty()) return stats;
+    std::sort(samples.begin(), samples.end());
+    size_t n = samples.size();
+    double sum = 0;
+    for (double s : samples) sum += s;
+    stats.mean = sum / n;
+    stats.median = n % 2 == 1 ? samples[n / 2] : (samples[n / 2 - 1] + samples[n / 2]) / 2;
+    // nearest rank
+    size_t rank = (size_t) std::ceil(0.95 * n);
+    stats.p95 = samples[std::max<size_t>(rank, 1) - 1];
+    double squares = 0;
+    for (double s : samples) squares += (s - stats.mean) * (s - stats.mean);
+    stats.stddev = n > 1 ? std::sqrt(squares / (n - 1)) : 0;
+    stats.min = samples.front();
+    stats.max = samples.back();
+    return stats;
+}
 
+// One key/value pair of the benchmark line, kept in order so every output format lists the same fields.
+struct ReportField {
+    std::string key;
+    std::string value;
+    bool quoted; // strings must be quoted in json
+};
+
+struct Report {
+    std::vector<ReportField> fields;
+
+    template <typename T>
+    void add(const std::string& key, const T& value) {
+        std::ostringstream ss;
+        ss << value;
+        fields.push_back({key, ss.str(), false});
+    }
+
+    void addString(const std::string& key, const std::string& value) {
+        fields.push_back({key, value, true});
+    }
+
+    void addBool(const std::string& key, bool value) {
+        fields.push_back({key, value ? "true" : "false", false});
+    }
+};
+
+void writeSexp(const Report& report, std::ostream& out) {
+    out << "(";
+    for (size_t i = 0; i < report.fields.size(); i++) {
+        if (i > 0) out << " ";
+        out << "(" << report.fields[i].key << " " << report.fields[i].value << ")";
+    }
+    out << ")";
+}
+
+void writeJson(const Report& report, std::ostream& out) {
+    out << "{";
+    for (size_t i = 0; i < report.fields.size(); i++) {
+        const ReportField& field = report.fields[i];
+        if (i > 0) out << ", ";
+        out << "\"" << field.key << "\": ";
+        if (field.quoted) {
+            out << "\"" << field.value << "\"";
+        } else {
+            out << field.value;
         }
     }
-    return cfg;
+    out << "}\n";
 }
 
-void runBenchmark(const std::string& program, const Config& cfg, uint32_t doc) {
+// header is false for every row but the first when several reports go to the same stream
+void writeCsv(const Report& report, std::ostream& out, bool header = true) {
+    if (header) {
+        for (size_t i = 0; i < report.fields.size(); i++) {
+            out << (i > 0 ? "," : "") << report.fields[i].key;
+        }
+        out << "\n";
+    }
+    for (size_t i = 0; i < report.fields.size(); i++) {
+        out << (i > 0 ? "," : "") << report.fields[i].value;
+    }
+    out << "\n";
+}
+
+void writeReport(const Report& report, const Config& cfg, std::ostream& out, bool header = true) {
+    if (cfg.format == "json") {
+        writeJson(report, out);
+    } else if (cfg.format == "csv") {
+        writeCsv(report, out, header);
+    } else {
+        writeSexp(report, out);
+    }
+}
+
+#if ENGINE_STATS
+void addEngineStats(Report& report) {
+    for (int i = 0; i < 7; i++) {
+        report.add(std::string("resolve-") + docTypeName((DocType) i), engineStats.resolveCalls[i]);
+    }
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    size_t cacheIds = std::max(engineStats.cacheHits.size(), engineStats.cacheMisses.size());
+    std::vector<std::pair<uint64_t, uint32_t>> byMisses; // (misses, cache_id)
+    for (size_t id = 0; id < cacheIds; id++) {
+        uint64_t h = id < engineStats.cacheHits.size() ? engineStats.cacheHits[id] : 0;
+        uint64_t m = id < engineStats.cacheMisses.size() ? engineStats.cacheMisses[id] : 0;
+        hits += h;
+        misses += m;
+        if (h + m > 0) byMisses.push_back({m, id});
+    }
+    report.add("cache-hits", hits);
+    report.add("cache-misses", misses);
+    report.add("cache-ids-used", byMisses.size());
+    // the cache ids that missed the most, as id:hits/misses
+    std::sort(byMisses.begin(), byMisses.end(), [](auto& a, auto& b) { return a.first > b.first; });
+    std::string top;
+    for (size_t i = 0; i < byMisses.size() && i < 5; i++) {
+        uint32_t id = byMisses[i].second;
+        uint64_t h = id < engineStats.cacheHits.size() ? engineStats.cacheHits[id] : 0;
+        top += (i > 0 ? ";" : "") + std::to_string(id) + ":" + std::to_string(h) + "/" + std::to_string(byMisses[i].first);
+    }
+    report.addString("cache-top-misses", top);
+    report.add("measures", engineStats.measuresAllocated);
+    report.add("tainted-trunks", engineStats.taintedTrunksAllocated);
+    report.add("scratch-growths", engineStats.scratchGrowths);
+    report.add("merge-comparisons", engineStats.mergeComparisons);
+    // bucket:count, where bucket is the smallest size in it and "tainted" counts tainted results
+    std::string histogram;
+    for (int i = 0; i < FRONTIER_HISTOGRAM_BUCKETS; i++) {
+        if (engineStats.frontierSizes[i] == 0) continue;
+        if (!histogram.empty()) histogram += ";";
+        histogram += (i == 0 ? std::string("tainted") : std::to_string(1ULL << (i - 1))) + ":" + std::to_string(engineStats.frontierSizes[i]);
+    }
+    report.addString("frontier-histogram", histogram);
+}
+#endif
+
+// times the greedy engine over the same iterations and reports its cost next to the optimal cost
+void addGreedyComparison(Report& report, const Config& cfg, uint32_t doc, const Output& optimal) {
+    std::vector<double> samples;
+    Output greedy;
+    for (size_t i = 0; i < cfg.warmup + cfg.iterations; i++) {
+        auto start = std::chrono::steady_clock::now();
+        greedy = print(doc, PrintEngine::GREEDY);
+        if (i >= cfg.warmup) samples.push_back(secondsSince(start));
+    }
+    report.add("width-cost", optimal.cost.widthCost);
+    report.add("line-cost", optimal.cost.lineCost);
+    report.add("greedy-duration", computeStats(samples).median);
+    report.add("greedy-width-cost", greedy.cost.widthCost);
+    report.add("greedy-line-cost", greedy.cost.lineCost);
+    report.add("greedy-lines", greedy.lineCount);
+    report.addString("greedy-md5", md5Hash(greedy.layout));
+}
+
+void addDagStats(Report& report, uint32_t root) {
+    auto start = std::chrono::steady_clock::now();
+    DagStats stats = dagStats(root);
+    report.add("dag-time", secondsSince(start));
+    report.add("dag-nodes", stats.nodes);
+    for (int i = 0; i < 7; i++) {
+        report.add(std::string("dag-") + docTypeName((DocType) i), stats.byType[i]);
+    }
+    report.add("dag-cacheable", stats.cacheable);
+    report.add("dag-choice-free", stats.choiceFree);
+    report.add("dag-max-depth", stats.maxDepth);
+    // parents per node, over every node but the root
+    report.add("dag-sharing", stats.nodes > 1 ? (double) stats.edges / (stats.nodes - 1) : 0.0);
+    report.add("dag-shared-nodes", stats.sharedNodes);
+    report.add("dag-max-parents", stats.maxParents);
+    report.add("dag-max-nl-count", stats.maxNlCount);
+    // bucket:count, where bucket is the smallest nlCount in it
+    std::string histogram;
+    for (int i = 0; i < NL_COUNT_HISTOGRAM_BUCKETS; i++) {
+        if (stats.nlCounts[i] == 0) continue;
+        if (!histogram.empty()) histogram += ";";
+        histogram += (i == 0 ? std::string("0") : std::to_string(1ULL << (i - 1))) + ":" + std::to_string(stats.nlCounts[i]);
+    }
+    report.addString("dag-nl-counts", histogram);
+}
+
+#if COMPACT_MEASURES
+// Saturated costs compare as equal, so the layout may not be optimal, the reported cost is still exact.
+void addCostSaturation(Report& report, bool saturated) {
+    report.addBool("cost-saturated?", saturated);
+    if (saturated) {
+        std::cerr << "Costs saturated in the compact measures, the layout may not be optimal, build without -DCOMPACT_MEASURES=1" << std::endl;
+    }
+}
+#endif
+
+// peak resident set size of this process in KiB
+long peakRssKb() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+void addMemoryReport(Report& report) {
+    MemoryReport memory = memoryReport();
+    report.add("mem-measure-slabs", memory.measureSlabs);
+    report.add("mem-tainted-trunk-slabs", memory.taintedTrunkSlabs);
+    report.add("mem-pools", memory.pools);
+    report.add("mem-measure-containers", memory.measureContainers);
+    report.add("mem-persistent-sets", memory.persistentSets);
+    report.add("mem-cache-maps", memory.cacheMaps);
+    report.add("mem-docs", memory.docs);
+    report.add("mem-strings", memory.strings);
+    report.add("mem-total", memory.total);
+    report.add("peak-rss-kb", peakRssKb());
+}
+
+struct BenchmarkRun {
+    Output result;
+    std::vector<double> samples;
+    TimingStats stats;
+    std::vector<PrintPhases> phases; // one per timed iteration
+    std::vector<PerfCounter> perfCounters; // totals over the timed iterations, empty when unavailable
+    #if ALLOC_TRACKING
+    AllocationCounts printAllocations = {0, 0, 0}; // totals over the timed iterations
+    #endif
+};
+
+// median of every print phase over the timed iterations
+PrintPhases medianPhases(const std::vector<PrintPhases>& phases) {
+    std::vector<double> resolve, expand, render;
+    for (const PrintPhases& p : phases) {
+        resolve.push_back(p.resolve);
+        expand.push_back(p.expand);
+        render.push_back(p.render);
+    }
+    return {computeStats(resolve).median, computeStats(expand).median, computeStats(render).median};
+}
+
+// Runs cfg.warmup untimed prints followed by cfg.iterations timed prints.
+// The engine is reset before every print so each iteration starts from a cold cache.
+BenchmarkRun timePrint(const Config& cfg, uint32_t doc) {
     computationWidth = cfg.computationWidth;
     pageWidth = cfg.pageWidth;
-    auto start = std::chrono::steady_clock::now();
-    Output result = print(doc);
-    auto stop = std::chrono::steady_clock::now();
-    std::chrono::duration<double> duration = stop - start;
+    BenchmarkRun run;
+    PerfCounters perf;
+    if (cfg.perf) perf.open();
+    for (size_t i = 0; i < cfg.warmup + cfg.iterations; i++) {
+        if (i > 0) resetPrintState();
+        ENGINE_STAT(resetEngineStats());
+        DOC_PROFILE_STAT(resetDocProfiles());
+        bool timed = i >= cfg.warmup;
+        #if RESOLVE_LOG
+        bool logging = i == cfg.warmup && !cfg.resolveLog.empty();
+        if (logging && !resolveLogStart(cfg.resolveLog, doc)) std::cerr << "Failed to create " << cfg.resolveLog << std::endl;
+        #endif
+        if (timed) perf.start();
+        #if ALLOC_TRACKING
+        AllocationCounts before = allocationCounts;
+        #endif
+        auto start = std::chrono::steady_clock::now();
+        run.result = print(doc);
+        auto stop = std::chrono::steady_clock::now();
+        #if ALLOC_TRACKING
+        AllocationCounts made = allocationsSince(before);
+        if (timed) {
+            run.printAllocations.news += made.news;
+            run.printAllocations.mallocs += made.mallocs;
+            run.printAllocations.bytes += made.bytes;
+        }
+        #endif
+        if (timed) perf.stop();
+        #if RESOLVE_LOG
+        if (logging) resolveLogStop();
+        #endif
+        std::chrono::duration<double> duration = stop - start;
+        if (i >= cfg.warmup) {
+            run.samples.push_back(duration.count());
+            run.phases.push_back(printPhases);
+        }
+    }
+    run.stats = computeStats(run.samples);
+    run.perfCounters = perf.counters;
+    perf.close();
+    return run;
+}
+
+// hardware counters per print, averaged over the timed iterations
+void addPerfCounters(Report& report, const BenchmarkRun& run) {
+    if (run.perfCounters.empty()) {
+        report.addString("perf", "unavailable");
+        return;
+    }
+    double cycles = -1;
+    double instructions = -1;
+    for (const PerfCounter& counter : run.perfCounters) {
+        double perPrint = counter.value / run.samples.size();
+        report.add("perf-" + counter.name, (uint64_t) perPrint);
+        if (counter.name == "cycles") cycles = perPrint;
+        if (counter.name == "instructions") instructions = perPrint;
+    }
+    if (cycles > 0 && instructions >= 0) report.add("perf-ipc", instructions / cycles);
+}
+
+void runBenchmark(const std::string& program, const Config& cfg, uint32_t doc) {
+    #if TRACE_EVENTS
+    if (!cfg.traceOut.empty()) traceStart(cfg.traceCapacity, (uint64_t) (cfg.traceThresholdUs * 1000));
+    #endif
+    BenchmarkRun run = timePrint(cfg, doc);
+    #if !RESOLVE_LOG
+    if (!cfg.resolveLog.empty()) std::cerr << "--resolve-log needs a build with -DRESOLVE_LOG=1" << std::endl;
+    #endif
+    if (!cfg.traceOut.empty()) {
+        #if TRACE_EVENTS
+        traceStop();
+        std::ofstream file(cfg.traceOut);
+        writeChromeTrace(file);
+        #else
+        std::cerr << "--trace-out needs a build with -DTRACE_EVENTS=1" << std::endl;
+        #endif
+    }
+    const Output& result = run.result;
 
     if (cfg.out.size() > 0) {
         if (cfg.out == "-") {
@@ -97,20 +482,275 @@ void runBenchmark(const std::string& program, const Config& cfg, uint32_t doc) {
         std::cout << "(width: " << result.cost.widthCost <<  " line: " << result.cost.lineCost <<")\n";
     }
 
-    size_t lineCount = 1;
-    for (char c : result.layout) {
-        if (c == '\n') ++lineCount;
+    if (!cfg.profileOut.empty()) {
+        #if DOC_PROFILE
+        std::ofstream file(cfg.profileOut);
+        bool dot = cfg.profileOut.size() >= 4 && cfg.profileOut.compare(cfg.profileOut.size() - 4, 4, ".dot") == 0;
+        if (dot) {
+            writeDocProfileDot(doc, file);
+        } else {
+            writeDocProfileJson(doc, file);
+        }
+        #else
+        std::cerr << "--profile-out needs a build with -DDOC_PROFILE=1" << std::endl;
+        #endif
     }
 
+    auto hashStart = std::chrono::steady_clock::now();
     std::string md5 = md5Hash(result.layout);
+    double hashTime = secondsSince(hashStart);
+    PrintPhases phases = medianPhases(run.phases);
 
-    std::cout << "((target pretty-expressive-cpp)"
-              << " (program " << program << ")"
-              << " (duration " << duration.count() << ")"
-              << " (lines " << lineCount << ")"
-              << " (size " << cfg.size << ")"
-              << " (md5 " << md5 << ")"
-              << " (page-width " << cfg.pageWidth << ")"
-              << " (computation-width " << cfg.computationWidth << ")"
-              << " (tainted? " << (result.isTainted ? "true" : "false") << "))";
+    Report report;
+    report.addString("target", "pretty-expressive-cpp");
+    report.addString("program", program);
+    // with several iterations the median is the headline number
+    report.add("duration", run.samples.size() == 1 ? run.samples[0] : run.stats.median);
+    report.add("lines", result.lineCount);
+    report.add("size", cfg.size);
+    report.addString("md5", md5);
+    report.add("page-width", cfg.pageWidth);
+    report.add("computation-width", cfg.computationWidth);
+    report.addBool("tainted?", result.isTainted);
+    #if COMPACT_MEASURES
+    addCostSaturation(report, costSaturated);
+    #endif
+    if (cfg.iterations > 1 || cfg.warmup > 0) {
+        report.add("warmup", cfg.warmup);
+        report.add("iterations", cfg.iterations);
+        report.add("mean", run.stats.mean);
+        report.add("median", run.stats.median);
+        report.add("p95", run.stats.p95);
+        report.add("stddev", run.stats.stddev);
+        report.add("min", run.stats.min);
+        report.add("max", run.stats.max);
+    }
+    report.add("parse", frontEndPhases.parse);
+    report.add("build", frontEndPhases.build);
+    report.add("resolve", phases.resolve);
+    report.add("expand", phases.expand);
+    report.add("render", phases.render);
+    report.add("hash", hashTime);
+    addMemoryReport(report);
+    if (cfg.greedy) addGreedyComparison(report, cfg, doc, result);
+    if (cfg.dagStats) addDagStats(report, doc);
+    if (cfg.perf) addPerfCounters(report, run);
+    #if ALLOC_TRACKING
+    // print allocations are per print, averaged over the timed iterations
+    report.add("alloc-build-new", buildAllocations.news);
+    report.add("alloc-build-malloc", buildAllocations.mallocs);
+    report.add("alloc-build-bytes", buildAllocations.bytes);
+    report.add("alloc-print-new", run.printAllocations.news / run.samples.size());
+    report.add("alloc-print-malloc", run.printAllocations.mallocs / run.samples.size());
+    report.add("alloc-print-bytes", run.printAllocations.bytes / run.samples.size());
+    #endif
+    #if ENGINE_STATS
+    addEngineStats(report);
+    #endif
+    writeReport(report, cfg, std::cout);
+}
+
+// Prints once with printStream, hashing and writing every chunk as it is emitted, and reports like runBenchmark.
+// build is the time spent in buildChunk minus the parse time buildChunk adds to frontEndPhases.parse,
+// duration includes both because reading and building are part of streaming.
+void runStreamBenchmark(const std::string& program, const Config& cfg, std::function<uint32_t(size_t)> buildChunk) {
+    computationWidth = cfg.computationWidth;
+    pageWidth = cfg.pageWidth;
+    Md5 md5;
+    std::ofstream file;
+    if (!cfg.out.empty() && cfg.out != "-") file.open(cfg.out);
+    std::ostream& out = cfg.out == "-" ? std::cout : file;
+    double buildTime = 0;
+    double parseBefore = frontEndPhases.parse;
+    #if ALLOC_TRACKING
+    // made by printing the chunks after the first one, which run on the memory the first chunks left behind
+    AllocationCounts laterChunks = {0, 0, 0};
+    AllocationCounts laterBuilds = {0, 0, 0};
+    #endif
+    auto start = std::chrono::steady_clock::now();
+    StreamOutput result = printStream([&](size_t chunk) {
+        #if ALLOC_TRACKING
+        if (chunk == 1) laterChunks = allocationCounts;
+        AllocationCounts beforeBuild = allocationCounts;
+        #endif
+        auto buildStart = std::chrono::steady_clock::now();
+        uint32_t doc = buildChunk(chunk);
+        buildTime += secondsSince(buildStart);
+        #if ALLOC_TRACKING
+        if (chunk >= 1) {
+            AllocationCounts made = allocationsSince(beforeBuild);
+            laterBuilds.news += made.news;
+            laterBuilds.mallocs += made.mallocs;
+            laterBuilds.bytes += made.bytes;
+        }
+        #endif
+        return doc;
+    }, [&](const std::string& layout) {
+        md5.update(layout);
+        if (!cfg.out.empty()) out << layout;
+    });
+    double duration = secondsSince(start);
+    #if ALLOC_TRACKING
+    if (result.chunks > 1) laterChunks = allocationsSince(laterChunks);
+    #endif
+
+    if (cfg.viewCost) {
+        std::cout << "(width: " << result.cost.widthCost <<  " line: " << result.cost.lineCost <<")\n";
+    }
+
+    Report report;
+    report.addString("target", "pretty-expressive-cpp");
+    report.addString("program", program);
+    report.add("duration", duration);
+    report.add("lines", result.lineCount);
+    report.add("size", cfg.size);
+    report.addString("md5", md5.hexDigest());
+    report.add("page-width", cfg.pageWidth);
+    report.add("computation-width", cfg.computationWidth);
+    report.addBool("tainted?", result.isTainted);
+    #if COMPACT_MEASURES
+    addCostSaturation(report, result.costSaturated);
+    #endif
+    report.add("stream-chunk", cfg.streamChunk);
+    report.add("chunks", result.chunks);
+    report.add("max-chunk-docs", result.maxChunkDocs);
+    report.add("parse", frontEndPhases.parse);
+    report.add("build", buildTime - (frontEndPhases.parse - parseBefore));
+    addMemoryReport(report);
+    #if ALLOC_TRACKING
+    // print allocations are per chunk, averaged over the chunks after the first, a single chunk has none to report
+    if (result.chunks > 1) {
+        report.add("alloc-print-new", (laterChunks.news - laterBuilds.news) / (result.chunks - 1));
+        report.add("alloc-print-malloc", (laterChunks.mallocs - laterBuilds.mallocs) / (result.chunks - 1));
+        report.add("alloc-print-bytes", (laterChunks.bytes - laterBuilds.bytes) / (result.chunks - 1));
+    }
+    #endif
+    writeReport(report, cfg, std::cout);
+}
+
+// Parses a sweep list: comma separated values or ranges, "lo:hi" and "lo:hi:step" step linearly, "lo:hi:xF" multiplies by F
+std::vector<size_t> parseSweepList(const std::string& list) {
+    std::vector<size_t> values;
+    for (const std::string& item : split(list, ',')) {
+        if (item.empty()) continue;
+        std::vector<std::string> parts = split(item, ':');
+        if (parts.size() == 1) {
+            values.push_back(std::stoul(parts[0]));
+            continue;
+        }
+        size_t lo = std::stoul(parts[0]);
+        size_t hi = std::stoul(parts[1]);
+        std::string step = parts.size() > 2 ? parts[2] : "1";
+        if (step[0] == 'x') {
+            size_t factor = std::stoul(step.substr(1));
+            if (factor < 2 || lo == 0) throw std::runtime_error("geometric sweep needs lo > 0 and a factor of at least 2: " + item);
+            for (size_t v = lo; v <= hi; v *= factor) values.push_back(v);
+        } else {
+            size_t increment = std::stoul(step);
+            if (increment == 0) throw std::runtime_error("sweep step must be positive: " + item);
+            for (size_t v = lo; v <= hi; v += increment) values.push_back(v);
+        }
+    }
+    return values;
+}
+
+const char* SWEEP_HEADER = "program,size,page-width,computation-width,status,duration,p95,peak-rss-kb,measures,cache-entries,docs,lines,tainted,md5\n";
+
+// Builds and prints one sweep point in a forked child, so every point starts from an empty engine
+// and ru_maxrss is the peak of that point alone. Returns the csv row.
+std::string runSweepPoint(const std::string& program, const Config& cfg, uint32_t (*build)(const Config&)) {
+    std::string prefix = program + "," + std::to_string(cfg.size) + "," + std::to_string(cfg.pageWidth) + "," + std::to_string(cfg.computationWidth) + ",";
+    int fds[2];
+    if (pipe(fds) != 0) return prefix + "pipe-failed,,,,,,,,,\n";
+    std::cout.flush();
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return prefix + "fork-failed,,,,,,,,,\n";
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        uint32_t doc = build(cfg);
+        BenchmarkRun run = timePrint(cfg, doc);
+        std::ostringstream row;
+        row << "ok," << (run.samples.size() == 1 ? run.samples[0] : run.stats.median)
+            << "," << run.stats.p95
+            << "," << peakRssKb()
+            << "," << measuresInUse()
+            << "," << cacheEntries()
+            << "," << docs.size()
+            << "," << run.result.lineCount
+            << "," << (run.result.isTainted ? "true" : "false")
+            << "," << md5Hash(run.result.layout) << "\n";
+        std::string text = row.str();
+        size_t written = 0;
+        while (written < text.size()) {
+            ssize_t n = write(fds[1], text.data() + written, text.size() - written);
+            if (n <= 0) break;
+            written += n;
+        }
+        close(fds[1]);
+        _exit(0);
+    }
+    close(fds[1]);
+    std::string row;
+    char buffer[256];
+    ssize_t n;
+    while ((n = read(fds[0], buffer, sizeof(buffer))) > 0) {
+        row.append(buffer, n);
+    }
+    close(fds[0]);
+    int status = 0;
+    waitpid(pid, &status, 0);
+    if (row.empty() || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        // most likely a stack overflow or running out of memory
+        return prefix + "crashed,,,,,,,,,\n";
+    }
+    return prefix + row;
+}
+
+// Runs the program for every combination of the sweep lists and writes one csv row per point.
+// Parameters without a sweep list keep their single value.
+void runSweep(const std::string& program, const Config& cfg, uint32_t (*build)(const Config&)) {
+    std::vector<size_t> sizes = cfg.sweepSizes.empty() ? std::vector<size_t>{cfg.size} : parseSweepList(cfg.sweepSizes);
+    std::vector<size_t> pageWidths = cfg.sweepPageWidths.empty() ? std::vector<size_t>{cfg.pageWidth} : parseSweepList(cfg.sweepPageWidths);
+    std::vector<size_t> computationWidths = cfg.sweepComputationWidths.empty() ? std::vector<size_t>{cfg.computationWidth} : parseSweepList(cfg.sweepComputationWidths);
+
+    std::ofstream file;
+    if (cfg.sweepOut != "-") file.open(cfg.sweepOut);
+    std::ostream& out = cfg.sweepOut == "-" ? std::cout : file;
+    out << SWEEP_HEADER;
+    for (size_t size : sizes) {
+        for (size_t pw : pageWidths) {
+            for (size_t cw : computationWidths) {
+                Config point = cfg;
+                point.size = size;
+                point.pageWidth = pw;
+                point.computationWidth = cw;
+                out << runSweepPoint(program, point, build);
+                out.flush();
+            }
+        }
+    }
+}
+
+// Entry point shared by the benchmark programs, build turns the configuration into a document.
+int benchmarkMain(const std::string& program, int argc, char* argv[], uint32_t (*build)(const Config&)) {
+    Config cfg = parseArgs(argc, argv);
+    if (!cfg.sweepSizes.empty() || !cfg.sweepPageWidths.empty() || !cfg.sweepComputationWidths.empty()) {
+        runSweep(program, cfg, build);
+        return 0;
+    }
+    #if ALLOC_TRACKING
+    AllocationCounts beforeBuild = allocationCounts;
+    #endif
+    auto buildStart = std::chrono::steady_clock::now();
+    uint32_t doc = build(cfg);
+    frontEndPhases.build = secondsSince(buildStart) - frontEndPhases.parse;
+    #if ALLOC_TRACKING
+    buildAllocations = allocationsSince(beforeBuild);
+    #endif
+    runBenchmark(program, cfg, doc);
+    return 0;
 }
@@ -9,10 +9,10 @@ uint32_t pp (uint64_t n) {
 }
 
 
+uint32_t build(const Config& cfg) {
+    return pp(cfg.size);
+}
+
 int main(int argc, char *argv[]) {
-    Config cfg = parseArgs(argc, argv);
-    
-    uint32_t parent = pp(cfg.size);
-    
-    runBenchmark ("concat", cfg, parent);
+    return benchmarkMain("concat", argc, argv, build);
 }
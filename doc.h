@@ -6,6 +6,8 @@
 #include <algorithm>
 #include <cstdint>
 #include <unordered_map>
+#include <unordered_set>
+#include <chrono>
 #define MEASURE_ARENA_SIZE 250
 #define NO_GC UINT32_MAX
 using namespace std;
@@ -47,6 +49,7 @@ struct Doc {
     DocType type;
     uint32_t nlCount;
     uint32_t cache_id;
+    bool choiceFree; // no CHOICE below this document, so it has exactly one layout
     // DocData data;
     union {
         TextDoc text;
@@ -66,12 +69,41 @@ struct Cost {
     uint64_t lineCost;
 };
 
-enum class MeasureType {CONCAT, TEXT, NEWLINE};
+enum class MeasureType {CONCAT, TEXT, NEWLINE, CHOICE_FREE};
 struct Measure; // forward declaration
 
+#if COMPACT_MEASURES
+// Measures take 16 bytes instead of 40, compile with -DCOMPACT_MEASURES=1 to use them.
+// Parents are 32 bit handles into the measure slabs, and cost, last, type and the flatten of a choice free measure
+// share a single word. That limits what a measure can hold:
+//  - widthCost up to COST_WIDTH_MAX (134217727), the overflow of a single line past pageWidth is squared,
+//    so one line 11586 columns too wide or 300 lines 669 columns too wide reach it
+//  - lineCost up to COST_LINE_MAX (262143) newlines
+//  - columns and indents of choice free measures up to 65535, larger ones are resolved without them
+//  - 2^32 measures, 2^18 slabs of MEASURE_SLAB_SIZE
+// Costs beyond the maximum saturate and set costSaturated. Saturated layouts compare as equal, so the choice between
+// them is no longer optimal, print still reports the exact cost of the layout it chose, see layoutCost.
+typedef uint32_t MeasureRef;
+#define NO_MEASURE UINT32_MAX
+#define MEASURE_SLAB_BITS 14
+#define MEASURE_SLAB_SIZE (1 << MEASURE_SLAB_BITS)
+#define COST_WIDTH_BITS 27
+#define COST_LINE_BITS 18
+#define COST_WIDTH_MAX ((1ULL << COST_WIDTH_BITS) - 1)
+#define COST_LINE_MAX ((1ULL << COST_LINE_BITS) - 1)
+// packed from the most significant bit: widthCost, lineCost, last, flatten, type
+#define PACKED_COST_SHIFT 19
+#define PACKED_LAST_SHIFT 3
+#define PACKED_FLATTEN_BIT 2
+#else
+typedef Measure* MeasureRef;
+#define NO_MEASURE nullptr
+#define MEASURE_SLAB_SIZE 10000
+#endif
+
 struct MeasureConcat {
-    Measure* parentLeft;
-    Measure* parentRight;
+    MeasureRef parentLeft;
+    MeasureRef parentRight;
 };
 
 struct MeasureText {
@@ -80,20 +112,48 @@ struct MeasureText {
 struct MeasureNewline {
     uint32_t indent; // technically this can be infered based on last, however we have free space due to the union
 };
+// the only layout of a choice free document, rendered from the document instead of a tree of measures
+struct MeasureChoiceFree {
+    uint32_t docId;
+    uint32_t col;
+    uint32_t indent;
+    bool flatten;
+};
+#if COMPACT_MEASURES
+// col and indent must fit in 16 bits, flatten is kept in the packed word
+struct PackedChoiceFree {
+    uint32_t docId;
+    uint16_t col;
+    uint16_t indent;
+};
+#endif
 
 // Measure must
 //  - Transform a document with choices to a choice less document
 //  - remember the cost of the document
+// Read and write the fields through measureType, measureCost, measureLast and setMeasure, they are packed with COMPACT_MEASURES.
 struct Measure {
     union {
         MeasureConcat concat;
         MeasureText text;
         MeasureNewline newline;
+#if COMPACT_MEASURES
+        PackedChoiceFree choiceFree;
+#else
+        MeasureChoiceFree choiceFree;
+#endif
     };
+#if COMPACT_MEASURES
+    uint64_t packed;
+#else
     MeasureType type;
     uint16_t last;
     Cost cost;
+#endif
 };
+#if COMPACT_MEASURES
+static_assert(sizeof(Measure) == 16, "compact measures take 16 bytes");
+#endif
 
 
 enum class TaintedTrunkType {LEFT, RIGHT, VALUE};
@@ -105,12 +165,12 @@ struct TaintedTrunkLeft
 };
 struct TaintedTrunkRight
 {
-    Measure leftMeasure;
+    MeasureRef leftMeasure;
     TaintedTrunk* rightTrunk;
 };
 struct TaintedTrunkValue
 {
-    Measure measure;
+    MeasureRef measure;
 };
 
 // tainted must be freed
@@ -119,6 +179,7 @@ struct TaintedTrunk {
     uint32_t indent;
     bool flatten;
     TaintedTrunkType type;
+    MeasureRef expanded; // set by expandTainted, cached tainted sets share their trunks so they are expanded once
     union {
         TaintedTrunkLeft left;
         TaintedTrunkRight right;
@@ -134,9 +195,11 @@ struct MeasureSetTainted
 {
     TaintedTrunk* trunk;
 };
+// A frontier: length measures starting at offset in scratchFrontiers, or in cachedFrontiers when offset has CACHED_FRONTIER set.
 struct MeasureSetValue
 {
-    vector<Measure*>* sets;
+    uint32_t offset;
+    uint32_t length;
 };
 
 struct MeasureSet
@@ -165,6 +228,47 @@ struct DocCache {
     }
 };
 
+// Allocator of the cache maps that keeps the nodes freed by clearing a map and hands them out again,
+// so once a print has filled the cache, printing after resetPrintState or dropDocsSince inserts without allocating.
+// Only single nodes are kept, bucket arrays stay with their map.
+size_t recycledCacheNodeBytes = 0; // for memoryReport
+template <typename T>
+struct RecyclingAllocator {
+    typedef T value_type;
+
+    // never destroyed, the global cache maps free their nodes after static destructors have run
+    static vector<T*>& recycled() {
+        static vector<T*>* nodes = new vector<T*>;
+        return *nodes;
+    }
+
+    RecyclingAllocator() {}
+    template <typename U> RecyclingAllocator(const RecyclingAllocator<U>&) {}
+
+    T* allocate(size_t n) {
+        if (n == 1 && !recycled().empty()) {
+            T* node = recycled().back();
+            recycled().pop_back();
+            recycledCacheNodeBytes -= sizeof(T);
+            return node;
+        }
+        return static_cast<T*>(::operator new(n * sizeof(T)));
+    }
+
+    void deallocate(T* ptr, size_t n) {
+        if (n == 1) {
+            recycled().push_back(ptr);
+            recycledCacheNodeBytes += sizeof(T);
+            return;
+        }
+        ::operator delete(ptr);
+    }
+};
+template <typename T, typename U> bool operator==(const RecyclingAllocator<T>&, const RecyclingAllocator<U>&) { return true; }
+template <typename T, typename U> bool operator!=(const RecyclingAllocator<T>&, const RecyclingAllocator<U>&) { return false; }
+
+typedef unordered_map<uint64_t, DocCache, hash<uint64_t>, equal_to<uint64_t>, RecyclingAllocator<pair<const uint64_t, DocCache>>> CacheMap;
+
 struct BlockAlloc {
     void* start;
     uint32_t remainingBytes;
@@ -180,82 +284,450 @@ vector<int> cacheWeight;
 // 
 #define SPACE_STRING_REF 0
 vector<string> strings = {" "};
-vector<unordered_map<uint64_t, DocCache>> cache;
+vector<CacheMap> cache;
+// cleared cache maps of dropped documents, handed to new cached documents before creating a map
+vector<CacheMap> spareCacheMaps;
 // Since measures might be short or long lived we allocate them in bulk, 
 // and if they are no longer need then return them to the pool
 // Measures are the part of the program that would have to optimized more,
-vector<Measure*> measurePool;
-vector<vector<Measure*>*> measureContainerPool;
+// MEASURE_SLAB_SIZE is defined with Measure, handles rely on it
+#define TAINTED_TRUNK_SLAB_SIZE 1000
+vector<MeasureRef> measurePool;
 vector<TaintedTrunk*> taintedTrunkPool;
+// every slab handed out by malloc, so the pools can be refilled when the print state is reset
+vector<Measure*> measureSlabs;
+vector<TaintedTrunk*> taintedTrunkSlabs;
 #if CLEAN_MEMORY
 // if the program has to continue afterwards we must free all of the memory we have allocated
-vector<vector<Measure*>*> persistentMeasureContainers; //TODO: free after program is done
 vector<void*> memoryLeaks;
 #endif
 
 
-#define MeasureContainer vector<Measure*>*
+#if ENGINE_STATS
+// Counters describing why a document is expensive, compile with -DENGINE_STATS=1 to enable them.
+// When disabled ENGINE_STAT expands to nothing, so the engine pays nothing for them.
+#define FRONTIER_HISTOGRAM_BUCKETS 17
+struct EngineStats {
+    uint64_t resolveCalls[7]; // indexed by DocType
+    vector<uint64_t> cacheHits; // indexed by cache_id
+    vector<uint64_t> cacheMisses; // indexed by cache_id
+    uint64_t measuresAllocated;
+    uint64_t taintedTrunksAllocated;
+    uint64_t scratchGrowths; // times a scratch stack moved to larger storage
+    uint64_t mergeComparisons;
+    // sizes of the measure sets computed by resolve, bucket i holds sizes in [2^(i-1), 2^i), bucket 0 holds tainted results
+    uint64_t frontierSizes[FRONTIER_HISTOGRAM_BUCKETS];
+};
+EngineStats engineStats;
+
+void resetEngineStats() {
+    engineStats = EngineStats();
+}
+
+void countCacheLookup(uint32_t cacheId, bool hit) {
+    vector<uint64_t>& counts = hit ? engineStats.cacheHits : engineStats.cacheMisses;
+    if (counts.size() <= cacheId) counts.resize(cacheId + 1);
+    counts[cacheId]++;
+}
+
+void countFrontier(size_t size, bool tainted) {
+    int bucket = 0;
+    if (!tainted) {
+        bucket = 1;
+        while (size > 1 && bucket < FRONTIER_HISTOGRAM_BUCKETS - 1) {
+            size >>= 1;
+            bucket++;
+        }
+    }
+    engineStats.frontierSizes[bucket]++;
+}
+#define ENGINE_STAT(statement) statement
+#else
+#define ENGINE_STAT(statement)
+#endif
+
+#if TRACE_EVENTS
+#include "trace.h"
+#define TRACE_EVENT(statement) statement
+#else
+#define TRACE_EVENT(statement)
+#endif
+
+#if RESOLVE_LOG
+#include "resolve-log.h"
+#define RESOLVE_LOG_EVENT(statement) statement
+#else
+#define RESOLVE_LOG_EVENT(statement)
+#endif
+
+#if DOC_PROFILE
+// Per document statistics, compile with -DDOC_PROFILE=1 and export them with writeDocProfileJson or writeDocProfileDot.
+// Only resolve calls made through resolveCached are attributed, timing is inclusive of the children.
+struct DocProfile {
+    uint64_t resolves;
+    uint64_t cacheMisses;
+    uint64_t measures; // total size of the measure sets resolve returned
+    uint64_t timeNs;
+};
+vector<DocProfile> docProfiles; // parallel array with docs
+
+void resetDocProfiles() {
+    docProfiles.assign(docs.size(), DocProfile());
+}
+
+DocProfile& docProfile(uint32_t docId) {
+    if (docProfiles.size() <= docId) docProfiles.resize(docs.size());
+    return docProfiles[docId];
+}
+#define DOC_PROFILE_STAT(statement) statement
+#else
+#define DOC_PROFILE_STAT(statement)
+#endif
+
+// A stack that follows the recursion of resolve: values are pushed on top, mark remembers the top and release pops back to it.
+// It starts with room for MEASURE_ARENA_SIZE values and grows by doubling.
+// It never shrinks, so once a print has grown it, later prints push without allocating.
+template <typename T>
+struct ScratchStack {
+    vector<T> heap = vector<T>(MEASURE_ARENA_SIZE);
+    T* values = heap.data();
+    uint32_t top = 0;
+    uint32_t capacity = MEASURE_ARENA_SIZE;
+
+    void push(T value) {
+        if (top == capacity) reserve(1);
+        values[top++] = value;
+    }
+
+    // Makes room for count more values, so pointers into the stack stay valid while they are pushed.
+    void reserve(size_t count) {
+        if (top + count <= capacity) return;
+        vector<T> grown(max<size_t>(top + count, 2 * (size_t) capacity));
+        copy(values, values + top, grown.data());
+        heap.swap(grown);
+        values = heap.data();
+        capacity = heap.size();
+        ENGINE_STAT(engineStats.scratchGrowths++);
+    }
+
+    uint32_t mark() {
+        return top;
+    }
+
+    void release(uint32_t mark) {
+        top = mark;
+    }
+
+    T& operator[](size_t index) {
+        return values[index];
+    }
+};
+
+// The frontiers of measure sets, see MeasureSetValue.
+// Cached frontiers are appended to a single slab and live until the print state is reset.
+// Scratch frontiers follow the recursion of resolve: a result is pushed on top, and whoever asked for it
+// pops it with scratchRelease once it has been consumed or copied to the cache.
+#define CACHED_FRONTIER 0x80000000u
+vector<MeasureRef> cachedFrontiers;
+ScratchStack<MeasureRef> scratchFrontiers;
+
+uint32_t scratchMark() {
+    return scratchFrontiers.mark();
+}
+
+// pops every scratch frontier pushed since mark
+void scratchRelease(uint32_t mark) {
+    scratchFrontiers.release(mark);
+}
 
-vector<Measure*>* borrowMeasureContainer() {
-    if (measureContainerPool.size() == 0) {
-        measureContainerPool.push_back(new vector<Measure*>);
+// Valid until the region of the frontier grows, the scratch frontiers grow whenever something is resolved.
+MeasureRef* frontierData(MeasureSetValue set) {
+    if (set.offset & CACHED_FRONTIER) {
+        return &cachedFrontiers[set.offset & ~CACHED_FRONTIER];
     }
-    auto take = measureContainerPool[measureContainerPool.size() - 1];
-    measureContainerPool.pop_back();
-    return take;
+    return &scratchFrontiers[set.offset];
+}
+
+// the scratch measures pushed since mark
+MeasureSetValue scratchFrontierSince(uint32_t mark) {
+    return {mark, scratchFrontiers.top - mark};
+}
+
+#if COMPACT_MEASURES
+Measure* measureAt(MeasureRef ref) {
+    return &measureSlabs[ref >> MEASURE_SLAB_BITS][ref & (MEASURE_SLAB_SIZE - 1)];
+}
+
+MeasureRef measureRefIn(size_t slab, int index) {
+    return (MeasureRef) (slab << MEASURE_SLAB_BITS) | index;
+}
+
+// set when a cost did not fit a measure, resetPrintState clears it with the measures
+bool costSaturated = false;
+
+uint64_t saturate(uint64_t value, uint64_t max) {
+    if (value <= max) return value;
+    costSaturated = true;
+    return max;
+}
+
+MeasureType measureType(const Measure* measure) {
+    return (MeasureType) (measure->packed & 3);
+}
+
+uint16_t measureLast(const Measure* measure) {
+    return (uint16_t) (measure->packed >> PACKED_LAST_SHIFT);
+}
+
+Cost measureCost(const Measure* measure) {
+    uint64_t cost = measure->packed >> PACKED_COST_SHIFT;
+    return {cost >> COST_LINE_BITS, cost & COST_LINE_MAX};
+}
+
+// last is truncated to 16 bits like the uint16_t field it replaces
+void setMeasure(Measure* measure, MeasureType type, Cost cost, uint32_t last) {
+    measure->packed = saturate(cost.widthCost, COST_WIDTH_MAX) << (COST_LINE_BITS + PACKED_COST_SHIFT)
+        | saturate(cost.lineCost, COST_LINE_MAX) << PACKED_COST_SHIFT
+        | (uint64_t) (uint16_t) last << PACKED_LAST_SHIFT
+        | (uint64_t) type;
+}
+
+// widthCost and lineCost compared at once, they are next to each other in the packed word
+bool measureCostLEQ(const Measure* left, const Measure* right) {
+    return (left->packed >> PACKED_COST_SHIFT) <= (right->packed >> PACKED_COST_SHIFT);
+}
+
+MeasureChoiceFree measureChoiceFreeOf(const Measure* measure) {
+    return {measure->choiceFree.docId, measure->choiceFree.col, measure->choiceFree.indent, ((measure->packed >> PACKED_FLATTEN_BIT) & 1) != 0};
+}
+
+// call after setMeasure, which clears flatten
+void setMeasureChoiceFree(Measure* measure, MeasureChoiceFree choiceFree) {
+    measure->choiceFree = {choiceFree.docId, (uint16_t) choiceFree.col, (uint16_t) choiceFree.indent};
+    if (choiceFree.flatten) measure->packed |= 1 << PACKED_FLATTEN_BIT;
+}
+
+// whether a choice free measure can hold col and indent
+bool choiceFreeFits(uint32_t col, uint32_t indent) {
+    return col <= UINT16_MAX && indent <= UINT16_MAX;
+}
+#else
+Measure* measureAt(MeasureRef ref) {
+    return ref;
+}
+
+MeasureRef measureRefIn(size_t slab, int index) {
+    return &measureSlabs[slab][index];
 }
 
-void releaseMeasureContainer(vector<Measure*>* container) {
-    container->clear();
-    measureContainerPool.push_back(container);
+MeasureType measureType(const Measure* measure) {
+    return measure->type;
 }
 
-Measure* allocateMeasure() {
+uint16_t measureLast(const Measure* measure) {
+    return measure->last;
+}
+
+Cost measureCost(const Measure* measure) {
+    return measure->cost;
+}
+
+void setMeasure(Measure* measure, MeasureType type, Cost cost, uint32_t last) {
+    measure->type = type;
+    measure->cost = cost;
+    measure->last = last;
+}
+
+bool costLEQ (Cost left, Cost right);
+bool measureCostLEQ(const Measure* left, const Measure* right) {
+    return costLEQ(left->cost, right->cost);
+}
+
+MeasureChoiceFree measureChoiceFreeOf(const Measure* measure) {
+    return measure->choiceFree;
+}
+
+void setMeasureChoiceFree(Measure* measure, MeasureChoiceFree choiceFree) {
+    measure->choiceFree = choiceFree;
+}
+
+bool choiceFreeFits(uint32_t, uint32_t) {
+    return true;
+}
+#endif
+
+void addMeasureSlab() {
+    int allocationSize = MEASURE_SLAB_SIZE;
+    void* m = malloc(sizeof(Measure) * allocationSize);
+    #if CLEAN_MEMORY
+    memoryLeaks.push_back(m)
+    #endif
+    Measure* measures = (Measure*) m;
+    measureSlabs.push_back(measures);
+    for (int i = 0; i < allocationSize; i++) {
+        measurePool.push_back(measureRefIn(measureSlabs.size() - 1, i));
+    }
+}
+
+MeasureRef allocateMeasure() {
     if (measurePool.size() == 0) {
         // if the pool is empty, then fill the pool
-        int allocationSize = 10000;
-        void* m = malloc(sizeof(Measure) * allocationSize);
-        #if CLEAN_MEMORY
-        memoryLeaks.push_back(m)
-        #endif
-        Measure* measures = (Measure*) m;
-        for (int i = 0; i < allocationSize; i++) {
-            measurePool.push_back(&measures[i]);
-        }
+        addMeasureSlab();
     }
     // take the last element in the pool
-    Measure* measure = measurePool[measurePool.size() - 1];
+    ENGINE_STAT(engineStats.measuresAllocated++);
+    MeasureRef measure = measurePool[measurePool.size() - 1];
     measurePool.pop_back();
     return measure;
 }
 
+void addTaintedTrunkSlab() {
+    int allocationSize = TAINTED_TRUNK_SLAB_SIZE;
+    void* m = malloc(sizeof(TaintedTrunk) * allocationSize);
+    #if CLEAN_MEMORY
+    memoryLeaks.push_back(m)
+    #endif
+    TaintedTrunk* trunks = (TaintedTrunk*) m;
+    taintedTrunkSlabs.push_back(trunks);
+    for (int i = 0; i < allocationSize; i++) {
+        taintedTrunkPool.push_back(&trunks[i]);
+    }
+}
+
 TaintedTrunk* allocateTaintedTrunk(TaintedTrunkType type, uint32_t col, uint32_t indent, bool flatten) {
     if (taintedTrunkPool.size() == 0) {
         // if the pool is empty, then fill the pool
-        int allocationSize = 1000;
-        void* m = malloc(sizeof(TaintedTrunk) * allocationSize);
-        #if CLEAN_MEMORY
-        memoryLeaks.push_back(m)
-        #endif
-        TaintedTrunk* trunks = (TaintedTrunk*) m;
-        for (int i = 0; i < allocationSize; i++) {
-            taintedTrunkPool.push_back(&trunks[i]);
-        }
+        addTaintedTrunkSlab();
     }
     // take the last element in the pool
+    ENGINE_STAT(engineStats.taintedTrunksAllocated++);
     TaintedTrunk* trunk = taintedTrunkPool[taintedTrunkPool.size() - 1];
     trunk->col = col;
     trunk->indent = indent;
     trunk->flatten = flatten;
     trunk->type = type;
+    trunk->expanded = NO_MEASURE;
     taintedTrunkPool.pop_back();
     return trunk;
 }
 
+// What the greedy engine's lookahead needs to know about a document, computed when the document is created
+// so the lookahead steps over a whole document at once. Widths saturate at UINT16_MAX, far beyond any pageWidth.
+struct GreedyWidth {
+    uint16_t width; // up to the first newline, or of the whole document when breaks is false
+    bool breaks;
+};
+struct GreedyWidths {
+    uint16_t flat; // of the whole document when it is flattened
+    GreedyWidth preferred; // choices take the alternative greedy tries first
+    GreedyWidth earliestBreak; // choices take the alternative that leaves the most room on the line
+};
+// parallel array with docs
+vector<GreedyWidths> greedyWidths;
+
+uint16_t greedyWidthAdd(uint32_t left, uint32_t right) {
+    return min<uint32_t>(left + right, UINT16_MAX);
+}
+
+GreedyWidth greedyConcatWidth(GreedyWidth left, GreedyWidth right) {
+    if (left.breaks) return left;
+    return {greedyWidthAdd(left.width, right.width), right.breaks};
+}
+
+// Of two alternatives the one that breaks, unless it is the longer one, otherwise the shorter one.
+GreedyWidth greedyEarliestBreak(GreedyWidth left, GreedyWidth right) {
+    if (left.breaks != right.breaks) {
+        GreedyWidth breaking = left.breaks ? left : right;
+        GreedyWidth other = left.breaks ? right : left;
+        return breaking.width <= other.width ? breaking : other;
+    }
+    return left.width <= right.width ? left : right;
+}
+
+// The alternative greedy tries first: the one with fewer newlines, the left one on ties.
+uint32_t greedyPreferred(uint32_t left, uint32_t right) {
+    return docs[right].nlCount < docs[left].nlCount ? right : left;
+}
+
+// Appends the widths of docId, the documents it refers to must have theirs already.
+void addGreedyWidths(uint32_t docId) {
+    Doc* doc = &docs[docId];
+    GreedyWidths widths;
+    switch (doc->type) {
+        case DocType::TEXT: {
+            uint16_t width = min<uint32_t>(doc->text.stringLength, UINT16_MAX);
+            widths = {width, {width, false}, {width, false}};
+            break;
+        }
+        case DocType::NEWLINE:
+            widths = {1, {0, true}, {0, true}};
+            break;
+        case DocType::CONCAT: {
+            GreedyWidths left = greedyWidths[doc->concat.leftDoc];
+            GreedyWidths right = greedyWidths[doc->concat.rightDoc];
+            widths = {greedyWidthAdd(left.flat, right.flat), greedyConcatWidth(left.preferred, right.preferred),
+                      greedyConcatWidth(left.earliestBreak, right.earliestBreak)};
+            break;
+        }
+        case DocType::CHOICE: {
+            GreedyWidths preferred = greedyWidths[greedyPreferred(doc->choice.leftDoc, doc->choice.rightDoc)];
+            widths = {preferred.flat, preferred.preferred,
+                      greedyEarliestBreak(greedyWidths[doc->choice.leftDoc].earliestBreak, greedyWidths[doc->choice.rightDoc].earliestBreak)};
+            break;
+        }
+        case DocType::NEST:
+            widths = greedyWidths[doc->nest.nestedDoc];
+            break;
+        case DocType::ALIGN:
+            widths = greedyWidths[doc->align.alignDoc];
+            break;
+        case DocType::FLATTEN: {
+            uint16_t flat = greedyWidths[doc->flatten.flattenDoc].flat;
+            widths = {flat, {flat, false}, {flat, false}};
+            break;
+        }
+    }
+    greedyWidths.push_back(widths);
+}
+
+// How large a document and its print are expected to get, counted in total rather than on top of what exists.
+// Front-ends estimate it from their input, e.g. the byte count of a JSON file or the number of words to fill.
+struct CapacityHint {
+    size_t docs;
+    size_t strings;
+    size_t cacheIds;
+    size_t measures;
+    size_t taintedTrunks;
+};
+
+// Presizes docs, cacheWeight, strings, cache and the measure and tainted trunk pools, and allocates the slabs
+// up front, so building and printing a document of the hinted size doesn't grow them by doubling and copying.
+// A hint that is too small only means the rest grows as usual.
+void reserveCapacity(const CapacityHint& hint) {
+    docs.reserve(hint.docs);
+    cacheWeight.reserve(hint.docs);
+    greedyWidths.reserve(hint.docs);
+    strings.reserve(hint.strings);
+    cache.reserve(hint.cacheIds);
+    size_t measureSlabCount = (hint.measures + MEASURE_SLAB_SIZE - 1) / MEASURE_SLAB_SIZE;
+    measureSlabs.reserve(measureSlabCount);
+    measurePool.reserve(measureSlabCount * MEASURE_SLAB_SIZE);
+    while (measureSlabs.size() < measureSlabCount) addMeasureSlab();
+    size_t taintedTrunkSlabCount = (hint.taintedTrunks + TAINTED_TRUNK_SLAB_SIZE - 1) / TAINTED_TRUNK_SLAB_SIZE;
+    taintedTrunkSlabs.reserve(taintedTrunkSlabCount);
+    taintedTrunkPool.reserve(taintedTrunkSlabCount * TAINTED_TRUNK_SLAB_SIZE);
+    while (taintedTrunkSlabs.size() < taintedTrunkSlabCount) addTaintedTrunkSlab();
+}
+
 void updateCache (uint32_t docId, int maxChildCacheDistance) {
     if (maxChildCacheDistance > cacheDistance) {
         docs[docId].cache_id = cache.size();
-        cache.push_back({});
+        if (spareCacheMaps.empty()) {
+            cache.push_back({});
+        } else {
+            cache.push_back(std::move(spareCacheMaps.back()));
+            spareCacheMaps.pop_back();
+        }
         cacheWeight.push_back(0);
     } else {
         cacheWeight.push_back(maxChildCacheDistance + 1);
@@ -264,16 +736,18 @@ void updateCache (uint32_t docId, int maxChildCacheDistance) {
 }
 
 uint32_t createText(string s) {
-    strings.push_back(s);
+    strings.push_back(std::move(s));
     uint32_t stringId = strings.size() - 1;
     Doc doc;
     doc.type = DocType::TEXT;
     doc.nlCount = 0;
-    doc.text = {stringId, (uint32_t) s.length()};
+    doc.choiceFree = true;
+    doc.text = {stringId, (uint32_t) strings[stringId].length()};
     docs.push_back(doc); 
 
     uint32_t docId = docs.size() - 1;
     updateCache(docId, 0);
+    addGreedyWidths(docId);
     return docId;
 }
 
@@ -282,10 +756,12 @@ uint32_t createNewline() {
     Doc doc;
     doc.type = DocType::NEWLINE;
     doc.nlCount = 1;
+    doc.choiceFree = true;
     docs.push_back(doc); 
 
     uint32_t docId = docs.size() - 1;
     updateCache(docId, 0);
+    addGreedyWidths(docId);
     return docId;
 }
 
@@ -293,12 +769,14 @@ uint32_t createConcat(uint32_t left, uint32_t right) {
     Doc doc;
     doc.type = DocType::CONCAT;
     doc.nlCount = docs[left].nlCount + docs[right].nlCount;
+    doc.choiceFree = docs[left].choiceFree && docs[right].choiceFree;
     doc.concat.leftDoc = left;
     doc.concat.rightDoc = right;
     docs.push_back(doc); 
 
     uint32_t docId = docs.size() - 1;
     updateCache(docId, max(cacheWeight[left],cacheWeight[right]));
+    addGreedyWidths(docId);
     return docId;
 }
 
@@ -306,12 +784,14 @@ uint32_t createChoice(uint32_t left, uint32_t right) {
     Doc doc;
     doc.type = DocType::CHOICE;
     doc.nlCount = max(docs[left].nlCount, docs[right].nlCount);
+    doc.choiceFree = false;
     doc.choice.leftDoc = left;
     doc.choice.rightDoc = right;
     docs.push_back(doc); 
 
     uint32_t docId = docs.size() - 1;
     updateCache(docId, max(cacheWeight[left],cacheWeight[right]));
+    addGreedyWidths(docId);
     return docId;
 }
 
@@ -319,11 +799,13 @@ uint32_t createFlatten(uint32_t inner) {
     Doc doc;
     doc.type = DocType::FLATTEN;
     doc.nlCount = 0;
+    doc.choiceFree = docs[inner].choiceFree;
     doc.flatten.flattenDoc = inner;
     docs.push_back(doc); 
 
     uint32_t docId = docs.size() - 1;
     updateCache(docId, cacheWeight[inner]);
+    addGreedyWidths(docId);
     return docId;
 }
 
@@ -331,11 +813,13 @@ uint32_t createAlign(uint32_t inner) {
     Doc doc;
     doc.type = DocType::ALIGN;
     doc.nlCount = docs[inner].nlCount;
+    doc.choiceFree = docs[inner].choiceFree;
     doc.align.alignDoc = inner;
     docs.push_back(doc); 
 
     uint32_t docId = docs.size() - 1;
     updateCache(docId, cacheWeight[inner]);
+    addGreedyWidths(docId);
     return docId;
 }
 
@@ -343,12 +827,14 @@ uint32_t createNest(uint32_t inner, uint32_t indent) {
     Doc doc;
     doc.type = DocType::NEST;
     doc.nlCount = docs[inner].nlCount;
+    doc.choiceFree = docs[inner].choiceFree;
     doc.nest.nestedDoc = inner;
     doc.nest.indent = indent;
     docs.push_back(doc); 
 
     uint32_t docId = docs.size() - 1;
     updateCache(docId, cacheWeight[inner]);
+    addGreedyWidths(docId);
     return docId;
 }
 uint32_t group(uint32_t inner) {
@@ -365,7 +851,7 @@ bool costLEQ (Cost left, Cost right) {
 
 
 bool measureLEQ (Measure* left, Measure* right) {
-    return costLEQ(left->cost, right->cost) && left->last <= right->last;
+    return measureCostLEQ(left, right) && measureLast(left) <= measureLast(right);
 }
 
 Cost costAdd (Cost l, Cost r) {
@@ -375,50 +861,59 @@ Cost costAdd (Cost l, Cost r) {
     };
 }
 
-Measure* measureConcat(Measure* left, Measure* right) {
-    Measure* newMeasure = allocateMeasure();
-    newMeasure->type = MeasureType::CONCAT;
+MeasureRef measureConcat(MeasureRef left, MeasureRef right) {
+    MeasureRef ref = allocateMeasure();
+    Measure* newMeasure = measureAt(ref);
+    Measure* rightMeasure = measureAt(right);
+    setMeasure(newMeasure, MeasureType::CONCAT, costAdd(measureCost(measureAt(left)), measureCost(rightMeasure)), measureLast(rightMeasure));
     newMeasure->concat.parentLeft = left;
     newMeasure->concat.parentRight = right;
-    newMeasure->cost = costAdd(left->cost, right->cost);
-    newMeasure->last = right->last;
-    return newMeasure;
+    return ref;
 }
 
 
-int mergeList(MeasureContainer leftArr, MeasureContainer rightArr, MeasureContainer result) {
-    int leftIndex = 0;
-    int rightIndex = 0;
-    while (leftIndex < leftArr->size() && rightIndex < rightArr->size()) {
-        Measure* left = (*leftArr)[leftIndex];
-        Measure* right = (*rightArr)[rightIndex];
+// pushes the merge of two frontiers on the scratch frontiers
+MeasureSetValue mergeList(MeasureSetValue leftSet, MeasureSetValue rightSet) {
+    scratchFrontiers.reserve(leftSet.length + rightSet.length);
+    MeasureRef* leftArr = frontierData(leftSet);
+    MeasureRef* rightArr = frontierData(rightSet);
+    ScratchStack<MeasureRef>& result = scratchFrontiers;
+    uint32_t offset = scratchMark();
+    uint32_t leftIndex = 0;
+    uint32_t rightIndex = 0;
+    while (leftIndex < leftSet.length && rightIndex < rightSet.length) {
+        MeasureRef leftRef = leftArr[leftIndex];
+        MeasureRef rightRef = rightArr[rightIndex];
+        Measure* left = measureAt(leftRef);
+        Measure* right = measureAt(rightRef);
+        ENGINE_STAT(engineStats.mergeComparisons++);
         if (measureLEQ(left, right)) {
             rightIndex++;
         } else if(measureLEQ(right, left)) {
             leftIndex++;
-        } else if(left->last > right->last) {
-            result->push_back(left);
+        } else if(measureLast(left) > measureLast(right)) {
+            result.push(leftRef);
             leftIndex++;
         } else {
-            result->push_back(right);
+            result.push(rightRef);
             rightIndex++;
         }
     }
     
     
-    while (leftIndex < leftArr->size()) {
-        Measure* left = (*leftArr)[leftIndex];
-        result->push_back(left);
+    while (leftIndex < leftSet.length) {
+        MeasureRef left = leftArr[leftIndex];
+        result.push(left);
         leftIndex++;
     }
 
-    while (rightIndex < rightArr->size()) {
-        Measure* right = (*rightArr)[rightIndex];
-        result->push_back(right);
+    while (rightIndex < rightSet.length) {
+        MeasureRef right = rightArr[rightIndex];
+        result.push(right);
         rightIndex++;
     }
 
-    return result->size();
+    return scratchFrontierSince(offset);
 }
 
 
@@ -528,42 +1023,271 @@ void printDoc (uint32_t docId, uint32_t indent) {
     cout << buf.str() << endl;
 }
 
+const char* docTypeName(DocType type) {
+    switch (type) {
+        case DocType::TEXT: return "text";
+        case DocType::NEWLINE: return "newline";
+        case DocType::CONCAT: return "concat";
+        case DocType::NEST: return "nest";
+        case DocType::ALIGN: return "align";
+        case DocType::CHOICE: return "choice";
+        case DocType::FLATTEN: return "flatten";
+    }
+    return "unknown";
+}
 
-MeasureSet mergeSet(MeasureSet leftSet, MeasureSet rightSet, MeasureContainer result) {
-    if (rightSet.type == MeasureSetType::TAINTED) {
-        if (leftSet.type == MeasureSetType::TAINTED) {
-            return leftSet;
+// writes the children of docId to children, returns how many there are
+int docChildren(uint32_t docId, uint32_t children[2]) {
+    Doc* doc = &docs[docId];
+    switch (doc->type) {
+        case DocType::TEXT:
+        case DocType::NEWLINE:
+            return 0;
+        case DocType::CONCAT:
+            children[0] = doc->concat.leftDoc;
+            children[1] = doc->concat.rightDoc;
+            return 2;
+        case DocType::CHOICE:
+            children[0] = doc->choice.leftDoc;
+            children[1] = doc->choice.rightDoc;
+            return 2;
+        case DocType::NEST:
+            children[0] = doc->nest.nestedDoc;
+            return 1;
+        case DocType::ALIGN:
+            children[0] = doc->align.alignDoc;
+            return 1;
+        case DocType::FLATTEN:
+            children[0] = doc->flatten.flattenDoc;
+            return 1;
+    }
+    return 0;
+}
+
+// Calls visit once for every document reachable from root, parents before children.
+// Uses an explicit stack, so it works on documents far deeper than the call stack allows.
+template <typename Visit>
+void forEachReachableDoc(uint32_t root, Visit visit) {
+    vector<bool> visited(docs.size(), false);
+    vector<uint32_t> stack = {root};
+    visited[root] = true;
+    uint32_t children[2];
+    while (!stack.empty()) {
+        uint32_t docId = stack.back();
+        stack.pop_back();
+        visit(docId);
+        int count = docChildren(docId, children);
+        // push right first so the left child is visited first
+        for (int i = count - 1; i >= 0; i--) {
+            if (!visited[children[i]]) {
+                visited[children[i]] = true;
+                stack.push_back(children[i]);
+            }
         }
-        MeasureSet ms;
-        ms.type = MeasureSetType::SET;
-        ms.set.sets = result;
-        // we must copy to result, because the container we are currently using is not going to survive
-        for (int i = 0; i < leftSet.set.sets->size(); i++) {
-            result->push_back((*leftSet.set.sets)[i]);
+    }
+}
+
+void writeEscaped(const string& s, ostream& out, size_t maxLength) {
+    for (size_t i = 0; i < s.size() && i < maxLength; i++) {
+        char c = s[i];
+        if (c == '"' || c == '\\') out << '\\' << c;
+        else if (c == '\n') out << "\\n";
+        else if ((unsigned char) c < 0x20) out << ' ';
+        else out << c;
+    }
+}
+
+#define NL_COUNT_HISTOGRAM_BUCKETS 33
+// Shape of the DAG reachable from a root, cheap enough to compute before print.
+struct DagStats {
+    size_t nodes;
+    size_t byType[7]; // indexed by DocType
+    size_t cacheable; // documents updateCache gave a cache id
+    size_t choiceFree;
+    uint32_t maxDepth; // longest path from the root, the root has depth 0
+    size_t edges;
+    size_t sharedNodes; // documents with more than one parent
+    uint32_t maxParents;
+    uint32_t maxNlCount;
+    size_t nlCounts[NL_COUNT_HISTOGRAM_BUCKETS]; // bucket 0 is nlCount 0, bucket i counts [2^(i-1), 2^i)
+};
+
+DagStats dagStats(uint32_t root) {
+    DagStats stats = DagStats();
+    vector<bool> reachable(docs.size(), false);
+    forEachReachableDoc(root, [&](uint32_t docId) { reachable[docId] = true; });
+    vector<uint32_t> depth(root + 1, 0);
+    vector<uint32_t> parents(root + 1, 0);
+    uint32_t children[2];
+    // documents only refer to documents created before them, so walking ids downwards visits parents first
+    for (int64_t docId = root; docId >= 0; docId--) {
+        if (!reachable[docId]) continue;
+        Doc* doc = &docs[docId];
+        stats.nodes++;
+        stats.byType[(int) doc->type]++;
+        if (doc->cache_id != 0) stats.cacheable++;
+        if (doc->choiceFree) stats.choiceFree++;
+        stats.maxDepth = max(stats.maxDepth, depth[docId]);
+        stats.maxParents = max(stats.maxParents, parents[docId]);
+        if (parents[docId] > 1) stats.sharedNodes++;
+        stats.maxNlCount = max(stats.maxNlCount, doc->nlCount);
+        int bucket = 0;
+        for (uint32_t n = doc->nlCount; n > 0; n >>= 1) bucket++;
+        stats.nlCounts[bucket]++;
+        int count = docChildren(docId, children);
+        for (int i = 0; i < count; i++) {
+            depth[children[i]] = max(depth[children[i]], depth[docId] + 1);
+            parents[children[i]]++;
+            stats.edges++;
         }
-        return ms;
-    } else if (leftSet.type == MeasureSetType::TAINTED) {
-        MeasureSet ms;
-        ms.type = MeasureSetType::SET;
-        ms.set.sets = result;
-        // we must copy to result, because the container we are currently using is not going to survive
-        for (int i = 0; i < rightSet.set.sets->size(); i++) {
-            result->push_back((*rightSet.set.sets)[i]);
+    }
+    return stats;
+}
+
+#if DOC_PROFILE
+// Streams the DAG reachable from root as {"root": id, "nodes": [...]}, every node with its type, children and profile.
+void writeDocProfileJson(uint32_t root, ostream& out) {
+    out << "{\"root\": " << root << ", \"nodes\": [\n";
+    bool first = true;
+    uint32_t children[2];
+    forEachReachableDoc(root, [&](uint32_t docId) {
+        Doc* doc = &docs[docId];
+        DocProfile& profile = docProfile(docId);
+        out << (first ? "" : ",\n") << "{\"id\": " << docId << ", \"type\": \"" << docTypeName(doc->type) << "\"";
+        if (doc->type == DocType::TEXT) {
+            out << ", \"text\": \"";
+            writeEscaped(strings[doc->text.stringRef], out, SIZE_MAX);
+            out << "\"";
         }
-        return ms;
+        out << ", \"children\": [";
+        int count = docChildren(docId, children);
+        for (int i = 0; i < count; i++) out << (i > 0 ? ", " : "") << children[i];
+        out << "], \"cacheable\": " << (doc->cache_id != 0 ? "true" : "false")
+            << ", \"resolves\": " << profile.resolves
+            << ", \"cacheMisses\": " << profile.cacheMisses
+            << ", \"measures\": " << profile.measures
+            << ", \"timeNs\": " << profile.timeNs << "}";
+        first = false;
+    });
+    out << "\n]}\n";
+}
+
+// Streams the DAG reachable from root as a Graphviz digraph, nodes are shaded by inclusive time relative to root.
+void writeDocProfileDot(uint32_t root, ostream& out) {
+    double rootTime = max<uint64_t>(docProfile(root).timeNs, 1);
+    out << "digraph doc {\n  node [shape=box, style=filled, fontname=monospace];\n";
+    uint32_t children[2];
+    forEachReachableDoc(root, [&](uint32_t docId) {
+        Doc* doc = &docs[docId];
+        DocProfile& profile = docProfile(docId);
+        double heat = min(1.0, profile.timeNs / rootTime);
+        out << "  n" << docId << " [label=\"" << docTypeName(doc->type) << " #" << docId;
+        if (doc->type == DocType::TEXT) {
+            out << " \\\"";
+            writeEscaped(strings[doc->text.stringRef], out, 20);
+            out << "\\\"";
+        }
+        out << "\\nresolves " << profile.resolves << " misses " << profile.cacheMisses
+            << "\\nmeasures " << profile.measures << " time " << profile.timeNs / 1000 << "us\""
+            << ", fillcolor=\"0.0 " << heat << " 1.0\"];\n";
+        int count = docChildren(docId, children);
+        for (int i = 0; i < count; i++) {
+            out << "  n" << docId << " -> n" << children[i] << ";\n";
+        }
+    });
+    out << "}\n";
+}
+#endif
+
+
+// a set wins over a tainted set, the frontiers stay where they are
+MeasureSet mergeSet(MeasureSet leftSet, MeasureSet rightSet) {
+    if (rightSet.type == MeasureSetType::TAINTED) {
+        return leftSet;
+    } else if (leftSet.type == MeasureSetType::TAINTED) {
+        return rightSet;
     } else {
-        int size = mergeList(leftSet.set.sets, rightSet.set.sets, result);
         MeasureSet ms;
         ms.type = MeasureSetType::SET;
-        ms.set.sets = result;
+        ms.set = mergeList(leftSet.set, rightSet.set);
         return ms;
     }
 }
 
-MeasureSet resolve (uint32_t docId, uint32_t col, uint32_t indent, bool flatten, MeasureContainer outputArena);
-MeasureSet resolveCached (uint32_t docId, uint32_t col, uint32_t indent, bool flatten, MeasureContainer outputArena);
+// Pops the scratch frontiers pushed since mark except the one ms refers to, which moves down to mark.
+MeasureSet keepFrontier(uint32_t mark, MeasureSet ms) {
+    if (ms.type == MeasureSetType::SET && !(ms.set.offset & CACHED_FRONTIER)) {
+        if (ms.set.offset != mark) {
+            MeasureRef* first = &scratchFrontiers[ms.set.offset];
+            copy(first, first + ms.set.length, &scratchFrontiers[mark]);
+            ms.set.offset = mark;
+        }
+        scratchRelease(mark + ms.set.length);
+    } else {
+        scratchRelease(mark);
+    }
+    return ms;
+}
+
+MeasureSet resolve (uint32_t docId, uint32_t col, uint32_t indent, bool flatten);
+MeasureSet resolveCached (uint32_t docId, uint32_t col, uint32_t indent, bool flatten);
+
+// A concatenation processConcat has not allocated yet, only candidates that survive dominance become measures.
+struct MeasureCandidate {
+    MeasureRef left;
+    MeasureRef right;
+    Cost cost;
+    uint16_t last;
+};
+// The candidates of the processConcat calls in progress, the concatenations with the left measure being processed.
+// A nested processConcat pushes its candidates above the ones of its caller and pops them before it returns.
+ScratchStack<MeasureCandidate> scratchCandidates;
+
+MeasureCandidate candidateConcat(MeasureRef left, Cost leftCost, MeasureRef right) {
+    Measure* rightMeasure = measureAt(right);
+    return {left, right, costAdd(leftCost, measureCost(rightMeasure)), measureLast(rightMeasure)};
+}
 
-MeasureSet processConcat (MeasureSet leftSet, uint32_t rightDocId, uint32_t col, uint32_t indent, bool flatten, MeasureContainer outputArena) {
+// measureConcat for a candidate, which already knows the cost and last
+MeasureRef measureFromCandidate(const MeasureCandidate& candidate) {
+    MeasureRef ref = allocateMeasure();
+    Measure* measure = measureAt(ref);
+    setMeasure(measure, MeasureType::CONCAT, candidate.cost, candidate.last);
+    measure->concat.parentLeft = candidate.left;
+    measure->concat.parentRight = candidate.right;
+    return ref;
+}
+
+// mergeList of the scratch frontier [left, leftEnd) and the candidates [right, rightEnd), pushed on the scratch frontiers.
+// A candidate is allocated once it makes it into the result.
+void mergeCandidates(uint32_t left, uint32_t leftEnd, const MeasureCandidate* right, const MeasureCandidate* rightEnd) {
+    ScratchStack<MeasureRef>& output = scratchFrontiers;
+    output.reserve(leftEnd - left + (rightEnd - right));
+    while (left < leftEnd && right != rightEnd) {
+        Measure* leftMeasure = measureAt(output[left]);
+        Cost leftCost = measureCost(leftMeasure);
+        uint16_t leftLast = measureLast(leftMeasure);
+        ENGINE_STAT(engineStats.mergeComparisons++);
+        if (costLEQ(leftCost, right->cost) && leftLast <= right->last) {
+            right++;
+        } else if (costLEQ(right->cost, leftCost) && right->last <= leftLast) {
+            left++;
+        } else if (leftLast > right->last) {
+            output.push(output[left]);
+            left++;
+        } else {
+            output.push(measureFromCandidate(*right));
+            right++;
+        }
+    }
+    for (; left < leftEnd; left++) output.push(output[left]);
+    for (; right != rightEnd; right++) output.push(measureFromCandidate(*right));
+}
+
+// pushes the result on the scratch frontiers
+MeasureSet processConcat (MeasureSet leftSet, uint32_t rightDocId, uint32_t col, uint32_t indent, bool flatten) {
+    TRACE_EVENT(TraceScope traceScope("processConcat", rightDocId, true));
+    TRACE_EVENT(traceScope.argNames[0] = "left"; traceScope.argNames[1] = "result");
     if (leftSet.type == MeasureSetType::TAINTED) {
         TaintedTrunk* trunk = allocateTaintedTrunk(TaintedTrunkType::LEFT, col, indent, flatten);
         trunk->left.leftTrunk = leftSet.tainted.trunk;
@@ -574,110 +1298,79 @@ MeasureSet processConcat (MeasureSet leftSet, uint32_t rightDocId, uint32_t col,
         ms.tainted.trunk = trunk;
         return ms;
     }
-    MeasureContainer one = borrowMeasureContainer();
-    MeasureContainer two = borrowMeasureContainer();
-    MeasureContainer childArena = borrowMeasureContainer();
-
-    // swap pointers because we can't keep writing to the same arena.
-    MeasureContainer nextArena = one; 
-    MeasureContainer currentArena = two; 
-    MeasureContainer tmp; // used for swapping
-    
-    bool hasResult = false;
-    MeasureSet result;
-
-    for (int leftIndex = 0; leftIndex < leftSet.set.sets->size(); leftIndex++) {
-        Measure* leftMeasure = (*leftSet.set.sets)[leftIndex];
-        childArena->clear();
-        MeasureSet rightSet = resolveCached(rightDocId, leftMeasure->last, indent, flatten, childArena);
+    // the concatenations with each left measure are deduplicated as candidates and merged into the frontier so far,
+    // only the ones that make it into the frontier are allocated.
+    // The frontier so far is [first, mergedEnd) on the scratch frontiers, below what resolving the right document pushes,
+    // each merge is pushed above it and moved down over it.
+    uint32_t first = scratchMark();
+    uint32_t mergedEnd = first;
+    bool hasSet = false;
+    uint32_t firstCandidate = scratchCandidates.mark();
+
+    // like mergeSet, any set wins over tainted results, and the first tainted result wins over the others
+    MeasureRef taintedLeft = NO_MEASURE;
+    TaintedTrunk* taintedRight = nullptr;
+
+    for (uint32_t leftIndex = 0; leftIndex < leftSet.set.length; leftIndex++) {
+        // resolving pushes scratch frontiers, which can move the left frontier, so it is looked up every time
+        MeasureRef leftMeasure = frontierData(leftSet.set)[leftIndex];
+        Measure* left = measureAt(leftMeasure);
+        Cost leftCost = measureCost(left);
+        MeasureSet rightSet = resolveCached(rightDocId, measureLast(left), indent, flatten);
         if (rightSet.type == MeasureSetType::TAINTED) {
-            TaintedTrunk* trunk = allocateTaintedTrunk(TaintedTrunkType::RIGHT, col, indent, flatten);
-            trunk->right.rightTrunk = rightSet.tainted.trunk;
-
-            trunk->right.leftMeasure = *leftMeasure;
-    
-            MeasureSet ms;
-            ms.type = MeasureSetType::TAINTED;
-            ms.tainted.trunk = trunk;
-            if (!hasResult) {
-                hasResult = true;
-                result = ms;
-            } else {
-                result = mergeSet(result, ms, nextArena);
-                tmp = nextArena; // swap pointers
-                nextArena = currentArena; // swap pointers
-                currentArena = tmp;
-                nextArena->clear();
+            if (taintedLeft == NO_MEASURE) {
+                taintedLeft = leftMeasure;
+                taintedRight = rightSet.tainted.trunk;
             }
-        } else {
-            // dedup algorithm
-            // 
-            outputArena->clear();
-            bool sawAFreeOption = false;
-            Measure* best = measureConcat(leftMeasure, (*rightSet.set.sets)[0]);
-            sawAFreeOption = best->cost.widthCost == 0 || sawAFreeOption;
-
-            for (int rightIndex = 1; rightIndex < rightSet.set.sets->size(); rightIndex++) {
-                Measure* rightMeasure = (*rightSet.set.sets)[rightIndex];
-                auto cost = costAdd(leftMeasure->cost, rightMeasure->cost);
-                if (costLEQ(cost, best->cost)) {
-                    best = measureConcat(leftMeasure, rightMeasure);
-                } else {
-                    outputArena->push_back(measureConcat(leftMeasure, rightMeasure));
-                }
-            }
-
-            outputArena->push_back(best);
-            // dedupSize++;
-            int dedupSize = outputArena->size();
-            for (int i = 0; i < outputArena->size() / 2; ++i) {
-                std::swap((*outputArena)[i], (*outputArena)[outputArena->size() - 1 - i]);
-            }
-
-            if (!hasResult) {
-                hasResult = true;
-                result.type = MeasureSetType::SET;
-                result.set.sets = nextArena;
-                for (int i = 0; i < outputArena->size(); i ++) {
-                    result.set.sets->push_back((*outputArena)[i]);
-                }
-                tmp = nextArena; // swap pointers
-                nextArena = currentArena; // swap pointers
-                currentArena = tmp;
-                nextArena->clear();
+            scratchRelease(mergedEnd);
+            continue;
+        }
+        // dedup algorithm
+        // the run is best followed by the other candidates in reverse
+        MeasureRef* rights = frontierData(rightSet.set);
+        scratchCandidates.push(candidateConcat(leftMeasure, leftCost, rights[0]));
+        MeasureCandidate best = scratchCandidates[firstCandidate];
+        for (size_t rightIndex = 1; rightIndex < rightSet.set.length; rightIndex++) {
+            MeasureCandidate candidate = candidateConcat(leftMeasure, leftCost, rights[rightIndex]);
+            if (costLEQ(candidate.cost, best.cost)) {
+                best = candidate;
             } else {
-                MeasureSet dedupedSet;
-                dedupedSet.type = MeasureSetType::SET;
-                dedupedSet.set.sets = outputArena;
-                result = mergeSet(result, dedupedSet, nextArena);
-
-                tmp = nextArena; // swap pointers
-                nextArena = currentArena; // swap pointers
-                currentArena = tmp;
-                nextArena->clear();
+                scratchCandidates.push(candidate);
+            }
+        }
+        scratchCandidates[firstCandidate] = best;
+        MeasureCandidate* run = scratchCandidates.values + firstCandidate;
+        MeasureCandidate* runEnd = scratchCandidates.values + scratchCandidates.top;
+        reverse(run + 1, runEnd);
+        scratchRelease(mergedEnd);
+
+        if (!hasSet) {
+            hasSet = true;
+            for (MeasureCandidate* candidate = run; candidate != runEnd; candidate++) {
+                scratchFrontiers.push(measureFromCandidate(*candidate));
             }
+        } else {
+            mergeCandidates(first, mergedEnd, run, runEnd);
+            copy(scratchFrontiers.values + mergedEnd, scratchFrontiers.values + scratchFrontiers.top, scratchFrontiers.values + first);
+            scratchRelease(first + (scratchFrontiers.top - mergedEnd));
         }
+        mergedEnd = scratchFrontiers.top;
+        scratchCandidates.release(firstCandidate);
     }
-    if (result.type == MeasureSetType::TAINTED) {
-        
-        releaseMeasureContainer(one);
-        releaseMeasureContainer(two);
-        releaseMeasureContainer(childArena);
-        return result;
+    MeasureSet result;
+    if (!hasSet) {
+        TaintedTrunk* trunk = allocateTaintedTrunk(TaintedTrunkType::RIGHT, col, indent, flatten);
+        trunk->right.rightTrunk = taintedRight;
+        trunk->right.leftMeasure = taintedLeft;
+        result.type = MeasureSetType::TAINTED;
+        result.tainted.trunk = trunk;
+        TRACE_EVENT(traceScope.args[0] = leftSet.set.length);
     } else {
-        MeasureSet ms;
-        ms.type = MeasureSetType::SET;
-        ms.set.sets = outputArena;
-        outputArena->clear();
-        for (int i = 0; i < result.set.sets->size(); i++) {
-            auto a = (*result.set.sets)[i];
-            outputArena->push_back(a);
-        }
-        releaseMeasureContainer(one);
-        releaseMeasureContainer(two);
-        releaseMeasureContainer(childArena);
-        return ms;
+        result.type = MeasureSetType::SET;
+        result.set = scratchFrontierSince(first);
+        TRACE_EVENT(traceScope.args[0] = leftSet.set.length; traceScope.args[1] = result.set.length);
     }
+    return result;
 }
 
 Cost costText (uint32_t col, uint32_t length) {
@@ -696,39 +1389,54 @@ Cost costNl () {
     return { 0, 1 };
 }
 
-MeasureSet resolveCached (uint32_t docId, uint32_t col, uint32_t indent, bool flatten, MeasureContainer arena) {
+#if DOC_PROFILE
+void recordResolve(uint32_t docId, chrono::steady_clock::time_point start, MeasureSet ms) {
+    DocProfile& profile = docProfile(docId);
+    profile.resolves++;
+    profile.timeNs += chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+    if (ms.type == MeasureSetType::SET) profile.measures += ms.set.length;
+}
+#endif
+
+// Cached results are in cachedFrontiers, the others are pushed on the scratch frontiers.
+MeasureSet resolveCached (uint32_t docId, uint32_t col, uint32_t indent, bool flatten) {
     Doc* doc = &docs[docId];
     if (doc->cache_id != 0) {
         auto key = cacheKey(col, indent, flatten);
         auto c = &cache[doc->cache_id];
         auto it = c->find(key);
         if (it != c->end()) {
+            ENGINE_STAT(countCacheLookup(doc->cache_id, true));
+            RESOLVE_LOG_EVENT(resolveLogRecord(docId, col, indent, flatten, ResolveOutcome::HIT, 0));
             return (*it).second.ms;
         }
+        ENGINE_STAT(countCacheLookup(doc->cache_id, false));
+        DOC_PROFILE_STAT(docProfile(docId).cacheMisses++);
 
         // auto find = findCacheIndex(cache[doc->cache_id], key);
         // if (find.found) {
         //     return find.foundCache->ms;
         // }
 
-        MeasureSet ms = resolve(docId, col, indent, flatten, arena);
+        DOC_PROFILE_STAT(auto profileStart = chrono::steady_clock::now());
+        TRACE_EVENT(uint64_t traceStart = traceNow());
+        uint32_t mark = scratchMark();
+        MeasureSet ms = resolve(docId, col, indent, flatten);
+        DOC_PROFILE_STAT(recordResolve(docId, profileStart, ms));
+        ENGINE_STAT(countFrontier(ms.type == MeasureSetType::SET ? ms.set.length : 0, ms.type == MeasureSetType::TAINTED));
+        // only slow misses are interesting, recording all of them would flood the buffer
+        TRACE_EVENT(if (traceNow() - traceStart >= traceBuffer.thresholdNs) traceComplete("resolveCached miss", traceStart, docId, "col", col, "measures", ms.type == MeasureSetType::SET ? ms.set.length : 0));
+        RESOLVE_LOG_EVENT(resolveLogRecord(docId, col, indent, flatten, ResolveOutcome::MISS, ms.type == MeasureSetType::SET ? ms.set.length : 0));
         
-        if (ms.type == MeasureSetType::SET) {
-            // we must move the pointers out of the arena, because the arena will disappear later
-            // also make sure the measures are not being garbage collected
+        if (ms.type == MeasureSetType::SET && !(ms.set.offset & CACHED_FRONTIER)) {
+            // we must move the frontier out of the scratch frontiers, because they will be popped later
             // note that we do not move the actual measures here, since they are already spatialy close due to being created at the same time.
-            // MeasureContainer persitentStorage = (MeasureContainer) persistentAlloc(sizeof(Measure*) * ms.set.sets->size());
-            MeasureContainer persistentStorage = new vector<Measure*>();
-            persistentStorage->reserve(ms.set.sets->size());
-            #if CLEAN_MEMORY
-            persistentMeasureContainers.push_back(persistentStorage);
-            #endif
-            for (int i = 0; i < ms.set.sets->size(); i++) {
-                Measure* m = (*ms.set.sets)[i];
-                persistentStorage->push_back(m);
-            }
-            ms.set.sets = persistentStorage;
+            MeasureRef* first = &scratchFrontiers[ms.set.offset];
+            uint32_t offset = cachedFrontiers.size();
+            cachedFrontiers.insert(cachedFrontiers.end(), first, first + ms.set.length);
+            ms.set.offset = offset | CACHED_FRONTIER;
         }
+        scratchRelease(mark);
         DocCache dc = DocCache::Create(key, ms);
         // insert into the array and ensure that it stays sorted
         // cache[doc->cache_id].insert(cache[doc->cache_id].begin() + find.missingIndex, c);
@@ -737,29 +1445,103 @@ MeasureSet resolveCached (uint32_t docId, uint32_t col, uint32_t indent, bool fl
         c->emplace(key,dc);
         return dc.ms;
     } else {
-        return resolve(docId, col, indent, flatten, arena);
+        RESOLVE_LOG_EVENT(resolveLogRecord(docId, col, indent, flatten, ResolveOutcome::UNCACHED, 0));
+        DOC_PROFILE_STAT(auto profileStart = chrono::steady_clock::now());
+        MeasureSet ms = resolve(docId, col, indent, flatten);
+        DOC_PROFILE_STAT(recordResolve(docId, profileStart, ms));
+        ENGINE_STAT(countFrontier(ms.type == MeasureSetType::SET ? ms.set.length : 0, ms.type == MeasureSetType::TAINTED));
+        return ms;
+    }
+}
+
+// Choice free walks that passed computationWidth. The walk fails for every document on the way down to the text that
+// passed it, started where the walk reached that document, so resolve remembers those instead of walking each of them
+// again, which made a tainted chain cost its length squared.
+unordered_set<uint64_t> failedChoiceFreeWalks;
+
+// only walks whose col and indent fit the key are remembered, the others are walked again
+bool choiceFreeWalkKeyFits(uint32_t col, uint32_t indent) {
+    return col <= UINT16_MAX && indent <= INT16_MAX;
+}
+
+uint64_t choiceFreeWalkKey(uint32_t docId, uint32_t col, uint32_t indent, bool flatten) {
+    return (uint64_t) docId << 32 | (uint64_t) col << 16 | (uint64_t) indent << 1 | (flatten ? 1 : 0);
+}
+
+bool choiceFreeWalkFailed(uint32_t docId, uint32_t col, uint32_t indent, bool flatten) {
+    return !failedChoiceFreeWalks.empty() && choiceFreeWalkKeyFits(col, indent)
+        && failedChoiceFreeWalks.count(choiceFreeWalkKey(docId, col, indent, flatten)) > 0;
+}
+
+// Walks the only layout of a choice free document like resolve would, adding its cost and moving col to where it ends.
+// Returns false as soon as a text passes computationWidth, then resolve has to build the tainted result.
+// col is truncated like Measure::last, so the result is exactly the measure resolve would have built.
+bool measureChoiceFree(uint32_t docId, uint32_t& col, uint32_t indent, bool flatten, Cost& cost) {
+    Doc* doc = &docs[docId];
+    uint32_t start = col;
+    bool fits = false;
+    switch (doc->type) {
+        case DocType::TEXT:
+            if (col + doc->text.stringLength > computationWidth) return false;
+            cost = costAdd(cost, costText(col, doc->text.stringLength));
+            col = (uint16_t) (col + doc->text.stringLength);
+            return true;
+        case DocType::NEWLINE:
+            if (flatten) {
+                if (col + 1 > computationWidth) return false;
+                cost = costAdd(cost, costText(col, 1));
+                col = (uint16_t) (col + 1);
+            } else {
+                cost = costAdd(cost, costNl());
+                col = (uint16_t) indent;
+            }
+            return true;
+        case DocType::CONCAT:
+            fits = measureChoiceFree(doc->concat.leftDoc, col, indent, flatten, cost)
+                && measureChoiceFree(doc->concat.rightDoc, col, indent, flatten, cost);
+            break;
+        case DocType::NEST:
+            fits = measureChoiceFree(doc->nest.nestedDoc, col, indent + doc->nest.indent, flatten, cost);
+            break;
+        case DocType::ALIGN:
+            fits = measureChoiceFree(doc->align.alignDoc, col, col, flatten, cost);
+            break;
+        case DocType::FLATTEN:
+            fits = measureChoiceFree(doc->flatten.flattenDoc, col, indent, true, cost);
+            break;
+        case DocType::CHOICE:
+            throw "choice in a choice free document";
+    }
+    if (!fits && choiceFreeWalkKeyFits(start, indent)) {
+        failedChoiceFreeWalks.insert(choiceFreeWalkKey(docId, start, indent, flatten));
     }
+    return fits;
 }
 
-MeasureSet measureSetForText(uint32_t stringRef, uint32_t strLen, uint32_t col, MeasureContainer arena) {
+// pushes a frontier of a single measure on the scratch frontiers
+MeasureSet singleMeasureSet(MeasureRef ref) {
+    MeasureSet ms;
+    ms.type = MeasureSetType::SET;
+    ms.set = {scratchMark(), 1};
+    scratchFrontiers.push(ref);
+    return ms;
+}
+
+MeasureSet measureSetForText(uint32_t stringRef, uint32_t strLen, uint32_t col) {
     if (col + strLen <= computationWidth) {
-        MeasureSet ms;
-        ms.type = MeasureSetType::SET;
-        ms.set.sets = arena;
-        Measure* measure = allocateMeasure();
-        measure->type = MeasureType::TEXT;
+        MeasureRef ref = allocateMeasure();
+        Measure* measure = measureAt(ref);
+        setMeasure(measure, MeasureType::TEXT, costText(col, strLen), strLen + col);
         measure->text.stringRef = stringRef;
-        measure->cost = costText(col, strLen);
-        measure->last = strLen + col;
-        ms.set.sets->push_back(measure);
-        return ms;
+        return singleMeasureSet(ref);
     } else {
         TaintedTrunk* trunk = allocateTaintedTrunk(TaintedTrunkType::VALUE, col, 0, false);
         trunk->type = TaintedTrunkType::VALUE;
-        trunk->value.measure.type = MeasureType::TEXT;
-        trunk->value.measure.text.stringRef = stringRef;
-        trunk->value.measure.cost = costText(col, strLen);
-        trunk->value.measure.last = strLen + col;
+        // the measure lives in a slab like every other, so concatenations can refer to it
+        trunk->value.measure = allocateMeasure();
+        Measure* measure = measureAt(trunk->value.measure);
+        setMeasure(measure, MeasureType::TEXT, costText(col, strLen), strLen + col);
+        measure->text.stringRef = stringRef;
         MeasureSet ms;
         ms.type = MeasureSetType::TAINTED;
         ms.tainted.trunk = trunk;
@@ -768,140 +1550,231 @@ MeasureSet measureSetForText(uint32_t stringRef, uint32_t strLen, uint32_t col,
 }
 
 /**
- * The arena is used to allow children to allow returning a list of pointers without allocation arrays themselves.
- *
+ * Results are pushed on the scratch frontiers, so children can return a list of pointers without allocating arrays themselves.
+ * Results passed through from resolveCached can be cached frontiers instead.
  */
-MeasureSet resolve (uint32_t docId, uint32_t col, uint32_t indent, bool flatten, MeasureContainer arena) {
-    // allocate a local arena on the stack children can write to
+MeasureSet resolve (uint32_t docId, uint32_t col, uint32_t indent, bool flatten) {
     // printDoc(docId, 0);
     // cout << endl;
     Doc* doc = &docs[docId];
+    ENGINE_STAT(engineStats.resolveCalls[(int) doc->type]++);
+    // a single measure stands for the whole layout, texts and newlines already are a single measure
+    if (doc->choiceFree && doc->type != DocType::TEXT && doc->type != DocType::NEWLINE && choiceFreeFits(col, indent)
+        && !choiceFreeWalkFailed(docId, col, indent, flatten)) {
+        uint32_t last = col;
+        Cost cost = {0, 0};
+        if (measureChoiceFree(docId, last, indent, flatten, cost)) {
+            MeasureRef ref = allocateMeasure();
+            Measure* measure = measureAt(ref);
+            setMeasure(measure, MeasureType::CHOICE_FREE, cost, last);
+            setMeasureChoiceFree(measure, {docId, col, indent, flatten});
+            return singleMeasureSet(ref);
+        }
+    }
     switch (doc->type)
     {
     case DocType::TEXT : {
-        return measureSetForText(doc->text.stringRef, doc->text.stringLength, col, arena);
+        return measureSetForText(doc->text.stringRef, doc->text.stringLength, col);
     }
     case DocType::NEWLINE : {
         if (flatten) {
-            return measureSetForText(SPACE_STRING_REF, 1, col, arena);
+            return measureSetForText(SPACE_STRING_REF, 1, col);
         } else {
-            MeasureSet ms;
-            ms.type = MeasureSetType::SET;
-            ms.set.sets = arena;
-            Measure* measure = allocateMeasure();
-            measure->type = MeasureType::NEWLINE;
+            MeasureRef ref = allocateMeasure();
+            Measure* measure = measureAt(ref);
+            setMeasure(measure, MeasureType::NEWLINE, costNl(), indent);
             measure->newline.indent = indent;
-            measure->cost = costNl();
-            measure->last = indent;
-            ms.set.sets->push_back(measure);
-            return ms;
+            return singleMeasureSet(ref);
         }
     }
     case DocType::ALIGN :
-        return resolveCached (doc->align.alignDoc, col, col, flatten, arena); // pass through the arena
+        return resolveCached (doc->align.alignDoc, col, col, flatten);
     case DocType::CONCAT :{
-        // Measure* childArena [MEASURE_ARENA_SIZE];
-        MeasureContainer childArena = borrowMeasureContainer();
-        MeasureSet leftSet = resolveCached (doc->concat.leftDoc, col, indent, flatten, childArena);
+        uint32_t mark = scratchMark();
+        MeasureSet leftSet = resolveCached (doc->concat.leftDoc, col, indent, flatten);
         // bool safe= left.type == MeasureSetType::SET && canReturnPerfect(left.set.sets, left.set.count); 
-        // use parent arena, because processConcat is used to return the value and therefore the value should survive.
-        MeasureSet ms =  processConcat(leftSet, doc->concat.rightDoc, col, indent, flatten, arena);
-
-        releaseMeasureContainer(childArena);
+        // the result is pushed above the left set, keepFrontier moves it down so the left set is popped.
+        MeasureSet ms =  processConcat(leftSet, doc->concat.rightDoc, col, indent, flatten);
         // bool safeAfter= ms.type == MeasureSetType::SET && canReturnPerfect(ms.set.sets, ms.set.count); 
         // if (safe && !safeAfter && ms.type == MeasureSetType::SET) {
         //     cout << "here " << endl;
         // }
-        return ms;
+        return keepFrontier(mark, ms);
     }
         
     case DocType::CHOICE : {
-        MeasureContainer childArenaLeft = borrowMeasureContainer();
-        MeasureContainer childArenaRight = borrowMeasureContainer();
+        uint32_t mark = scratchMark();
 
         Doc* leftDoc = &docs[doc->concat.leftDoc];
         Doc* rightDoc = &docs[doc->concat.rightDoc];
         
         if (rightDoc->nlCount < leftDoc->nlCount) {
-            MeasureSet leftSet = resolveCached (doc->choice.leftDoc, col, indent, flatten, childArenaLeft);
-            MeasureSet rightSet = resolveCached (doc->choice.rightDoc, col, indent, flatten, childArenaRight);
-            MeasureSet ms = mergeSet(leftSet, rightSet, arena);
-            releaseMeasureContainer(childArenaRight);
-            releaseMeasureContainer(childArenaLeft);
-            return ms;
+            MeasureSet leftSet = resolveCached (doc->choice.leftDoc, col, indent, flatten);
+            MeasureSet rightSet = resolveCached (doc->choice.rightDoc, col, indent, flatten);
+            MeasureSet ms = mergeSet(leftSet, rightSet);
+            return keepFrontier(mark, ms);
         } else {
-            MeasureSet rightSet = resolveCached (doc->choice.rightDoc, col, indent, flatten, childArenaRight);
-            MeasureSet leftSet = resolveCached (doc->choice.leftDoc, col, indent, flatten, childArenaLeft);
+            MeasureSet rightSet = resolveCached (doc->choice.rightDoc, col, indent, flatten);
+            MeasureSet leftSet = resolveCached (doc->choice.leftDoc, col, indent, flatten);
 
             
-            MeasureSet ms = mergeSet(rightSet, leftSet, arena);
-            releaseMeasureContainer(childArenaRight);
-            releaseMeasureContainer(childArenaLeft);
-            return ms;
+            MeasureSet ms = mergeSet(rightSet, leftSet);
+            return keepFrontier(mark, ms);
         }
     }
     case DocType::FLATTEN :{
-        return resolveCached (doc->flatten.flattenDoc, col, indent, true, arena); // pass through the arena
+        return resolveCached (doc->flatten.flattenDoc, col, indent, true);
     }
     case DocType::NEST : {
-        return resolveCached (doc->nest.nestedDoc, col, indent + doc->nest.indent, flatten, arena); // pass through the arena
+        return resolveCached (doc->nest.nestedDoc, col, indent + doc->nest.indent, flatten);
     }
     }
     throw "unhandled syntax";
 }
 
-Measure* expandTainted (TaintedTrunk* trunk) {
+MeasureRef expandTainted (TaintedTrunk* trunk) {
     if (trunk->type == TaintedTrunkType::VALUE) {
-        return &trunk->value.measure; // works if we never release the tainted trunk
-    } else if(trunk->type == TaintedTrunkType::RIGHT) {
-        Measure* rightMeasure = expandTainted(trunk->right.rightTrunk);
-        return measureConcat(&trunk->right.leftMeasure, rightMeasure);
+        return trunk->value.measure;
+    }
+    if (trunk->expanded != NO_MEASURE) {
+        return trunk->expanded;
+    }
+    if(trunk->type == TaintedTrunkType::RIGHT) {
+        MeasureRef rightMeasure = expandTainted(trunk->right.rightTrunk);
+        trunk->expanded = measureConcat(trunk->right.leftMeasure, rightMeasure);
     }else {
-        Measure* leftMeasure = expandTainted(trunk->left.leftTrunk);
-        // Measure* arena [MEASURE_ARENA_SIZE];
-        MeasureContainer arena = borrowMeasureContainer();
-        MeasureSet ms = resolve(trunk->left.rightDoc, leftMeasure->last, trunk->indent, trunk->flatten, arena);
+        MeasureRef leftMeasure = expandTainted(trunk->left.leftTrunk);
+        uint32_t mark = scratchMark();
+        // the right document is often resolved at the same column by other trunks, or was already during resolution
+        MeasureSet ms = resolveCached(trunk->left.rightDoc, measureLast(measureAt(leftMeasure)), trunk->indent, trunk->flatten);
         if (ms.type == MeasureSetType::TAINTED) {
-            Measure* expanded = expandTainted(ms.tainted.trunk);
-            return measureConcat(leftMeasure, expanded);
+            MeasureRef expanded = expandTainted(ms.tainted.trunk);
+            trunk->expanded = measureConcat(leftMeasure, expanded);
         } else {
-            Measure* m = measureConcat(leftMeasure, (*ms.set.sets)[0]); // return the first result (we can't release this memory since it is used to render, sorry borrowMeasureContainer)
-            return m;
+            trunk->expanded = measureConcat(leftMeasure, frontierData(ms.set)[0]); // the first result
         }
+        scratchRelease(mark); // only the measure is kept, it lives in a slab
     }
+    return trunk->expanded;
 }
 
 
-void renderChoiceLess (Measure* choiceLess, stringbuf& buf) {
-    switch (choiceLess->type)
+// a newline and its indentation, without building a string of spaces that would allocate for deep indents
+void putNewline(stringbuf& buf, uint32_t indent) {
+    buf.sputc('\n');
+    for (uint32_t i = 0; i < indent; i++) buf.sputc(' ');
+}
+
+// renders the layout measureChoiceFree walked, col is tracked the same way for align
+void renderChoiceFree(uint32_t docId, uint32_t& col, uint32_t indent, bool flatten, stringbuf& buf, uint64_t& newlines) {
+    Doc* doc = &docs[docId];
+    switch (doc->type) {
+        case DocType::TEXT: {
+            auto str = &strings[doc->text.stringRef];
+            buf.sputn(str->c_str(), str->length());
+            newlines += count(str->begin(), str->end(), '\n');
+            col = (uint16_t) (col + doc->text.stringLength);
+            return;
+        }
+        case DocType::NEWLINE:
+            if (flatten) {
+                buf.sputn(" ", 1);
+                col = (uint16_t) (col + 1);
+            } else {
+                newlines++;
+                putNewline(buf, indent);
+                col = (uint16_t) indent;
+            }
+            return;
+        case DocType::CONCAT:
+            renderChoiceFree(doc->concat.leftDoc, col, indent, flatten, buf, newlines);
+            renderChoiceFree(doc->concat.rightDoc, col, indent, flatten, buf, newlines);
+            return;
+        case DocType::NEST:
+            renderChoiceFree(doc->nest.nestedDoc, col, indent + doc->nest.indent, flatten, buf, newlines);
+            return;
+        case DocType::ALIGN:
+            renderChoiceFree(doc->align.alignDoc, col, col, flatten, buf, newlines);
+            return;
+        case DocType::FLATTEN:
+            renderChoiceFree(doc->flatten.flattenDoc, col, indent, true, buf, newlines);
+            return;
+        case DocType::CHOICE:
+            break;
+    }
+    throw "choice in a choice free document";
+}
+
+// newlines counts every '\n' written, so callers get the line count without rescanning the layout
+void renderChoiceLess (MeasureRef ref, stringbuf& buf, uint64_t& newlines) {
+    Measure* choiceLess = measureAt(ref);
+    switch (measureType(choiceLess))
     {
     case MeasureType::CONCAT:{
-        renderChoiceLess(choiceLess->concat.parentLeft, buf);
-        renderChoiceLess(choiceLess->concat.parentRight, buf);
+        renderChoiceLess(choiceLess->concat.parentLeft, buf, newlines);
+        renderChoiceLess(choiceLess->concat.parentRight, buf, newlines);
         return;
     }
 
     case MeasureType::TEXT:{
         auto str = &strings[choiceLess->text.stringRef];
         buf.sputn(str->c_str(), str->length());
+        newlines += count(str->begin(), str->end(), '\n'); // text is allowed to contain newlines
         return;
     }
 
     case MeasureType::NEWLINE:{
-        char ch = ' ';
-        string repeated(choiceLess->newline.indent, ch);  
-        buf.sputn("\n", 1);
-        buf.sputn(repeated.c_str(), repeated.size());
+        newlines++;
+        putNewline(buf, choiceLess->newline.indent);
+        return;
+    }
+
+    case MeasureType::CHOICE_FREE:{
+        MeasureChoiceFree choiceFree = measureChoiceFreeOf(choiceLess);
+        uint32_t col = choiceFree.col;
+        renderChoiceFree(choiceFree.docId, col, choiceFree.indent, choiceFree.flatten, buf, newlines);
         return;
     }
     }
     throw "Render missing case";
 }
+#if COMPACT_MEASURES
+// The cost of the layout of a measure, added up again from its texts and newlines so it does not saturate.
+// col is the column the layout starts on, it is moved to where the layout ends and truncated like Measure::last.
+Cost layoutCost(MeasureRef ref, uint32_t& col) {
+    Measure* measure = measureAt(ref);
+    switch (measureType(measure)) {
+    case MeasureType::CONCAT: {
+        Cost left = layoutCost(measure->concat.parentLeft, col);
+        return costAdd(left, layoutCost(measure->concat.parentRight, col));
+    }
+    case MeasureType::TEXT: {
+        uint32_t length = (uint16_t) (measureLast(measure) - col);
+        Cost cost = costText(col, length);
+        col = measureLast(measure);
+        return cost;
+    }
+    case MeasureType::NEWLINE:
+        col = measure->newline.indent;
+        return costNl();
+    case MeasureType::CHOICE_FREE: {
+        MeasureChoiceFree choiceFree = measureChoiceFreeOf(measure);
+        Cost cost = {0, 0};
+        col = choiceFree.col;
+        measureChoiceFree(choiceFree.docId, col, choiceFree.indent, choiceFree.flatten, cost);
+        return cost;
+    }
+    }
+    throw "Render missing case";
+}
+#endif
+
 //usefull for debugging
-string renderChoiceLessNow (Measure* choiceLess) {
+string renderChoiceLessNow (MeasureRef choiceLess) {
     try {
         stringbuf buf;
-        renderChoiceLess(choiceLess, buf);
+        uint64_t newlines = 0;
+        renderChoiceLess(choiceLess, buf, newlines);
         return buf.str();
     } catch (const char* e) {
         return "nope";
@@ -910,12 +1783,13 @@ string renderChoiceLessNow (Measure* choiceLess) {
 string renderChoiceLessSetNow (MeasureSet choiceLess) {
     try {
         stringbuf buf;
+        uint64_t newlines = 0;
         if (choiceLess.type == MeasureSetType::TAINTED) {
-            renderChoiceLess(expandTainted(choiceLess.tainted.trunk), buf);
-        } else if(choiceLess.set.sets->size() == 0) {
+            renderChoiceLess(expandTainted(choiceLess.tainted.trunk), buf, newlines);
+        } else if(choiceLess.set.length == 0) {
             return "";
         } else  {
-            renderChoiceLess((*choiceLess.set.sets)[0], buf);
+            renderChoiceLess(frontierData(choiceLess.set)[0], buf, newlines);
         }
         return buf.str();
     } catch (const char* e) {
@@ -923,24 +1797,390 @@ string renderChoiceLessSetNow (MeasureSet choiceLess) {
     }
 }
 
+// Forget everything print has computed (cache entries, measures and tainted trunks) but keep the documents,
+// so the same document can be printed again from a cold cache, e.g. between benchmark iterations.
+// The slabs are kept and handed out again, so only the cache maps have to allocate on the next print.
+void resetPrintState() {
+    for (auto& docCache : cache) {
+        docCache.clear();
+    }
+    cachedFrontiers.clear();
+    failedChoiceFreeWalks.clear();
+    #if COMPACT_MEASURES
+    costSaturated = false;
+    #endif
+    scratchFrontiers.release(0);
+    scratchCandidates.release(0);
+
+    measurePool.clear();
+    for (size_t slab = 0; slab < measureSlabs.size(); slab++) {
+        for (int i = 0; i < MEASURE_SLAB_SIZE; i++) {
+            measurePool.push_back(measureRefIn(slab, i));
+        }
+    }
+    taintedTrunkPool.clear();
+    for (TaintedTrunk* slab : taintedTrunkSlabs) {
+        for (int i = 0; i < TAINTED_TRUNK_SLAB_SIZE; i++) {
+            taintedTrunkPool.push_back(&slab[i]);
+        }
+    }
+}
+
+// Moves the cache maps from cacheIds on to the spares, they must be empty.
+void spareCacheMapsSince(size_t cacheIds) {
+    for (size_t cacheId = cacheIds; cacheId < cache.size(); cacheId++) {
+        spareCacheMaps.push_back(std::move(cache[cacheId]));
+    }
+    cache.resize(cacheIds);
+}
+
+// Recomputes which documents are cached and which are choice free, e.g. after changing cacheDistance or loading documents,
+// and drops everything print has computed.
+// Documents only refer to documents created before them, so a single pass in creation order is enough.
+void recomputeCacheIds() {
+    resetPrintState();
+    spareCacheMapsSince(0);
+    cacheWeight.clear();
+    greedyWidths.clear();
+    for (uint32_t docId = 0; docId < docs.size(); docId++) {
+        Doc* doc = &docs[docId];
+        int weight = 0;
+        doc->choiceFree = doc->type != DocType::CHOICE;
+        uint32_t children[2];
+        int count = docChildren(docId, children);
+        for (int i = 0; i < count; i++) {
+            doc->choiceFree = doc->choiceFree && docs[children[i]].choiceFree;
+        }
+        switch (doc->type) {
+            case DocType::TEXT:
+            case DocType::NEWLINE:
+                break;
+            case DocType::CONCAT:
+                weight = max(cacheWeight[doc->concat.leftDoc], cacheWeight[doc->concat.rightDoc]);
+                break;
+            case DocType::CHOICE:
+                weight = max(cacheWeight[doc->choice.leftDoc], cacheWeight[doc->choice.rightDoc]);
+                break;
+            case DocType::NEST:
+                weight = cacheWeight[doc->nest.nestedDoc];
+                break;
+            case DocType::ALIGN:
+                weight = cacheWeight[doc->align.alignDoc];
+                break;
+            case DocType::FLATTEN:
+                weight = cacheWeight[doc->flatten.flattenDoc];
+                break;
+        }
+        updateCache(docId, weight);
+        addGreedyWidths(docId);
+    }
+}
+
+// Where docs, strings and cache ids end, so the documents created afterwards can be dropped again.
+struct DocMark {
+    size_t docs;
+    size_t strings;
+    size_t cacheIds;
+};
+
+DocMark docMark() {
+    return {docs.size(), strings.size(), cache.size()};
+}
+
+// Drops every document created since mark together with everything print has computed.
+// docs, the slabs and the cache maps keep their capacity, so a loop that builds, prints and drops documents stops growing,
+// and stops allocating in the engine once it has printed its largest document.
+void dropDocsSince(DocMark mark) {
+    resetPrintState();
+    docs.resize(mark.docs);
+    cacheWeight.resize(mark.docs);
+    greedyWidths.resize(mark.docs);
+    strings.resize(mark.strings);
+    spareCacheMapsSince(mark.cacheIds);
+}
+
+// Drops every document, for programs that print many unrelated documents one after another.
+void resetDocs() {
+    dropDocsSince({0, SPACE_STRING_REF + 1, 0});
+}
+
+size_t measuresInUse() {
+    return measureSlabs.size() * MEASURE_SLAB_SIZE - measurePool.size();
+}
+
+size_t cacheEntries() {
+    size_t entries = 0;
+    for (auto& docCache : cache) entries += docCache.size();
+    return entries;
+}
+
+// Bytes held by each of the engine's structures, including reserved but unused capacity.
+// Heap bookkeeping is not included, so the numbers are a lower bound.
+struct MemoryReport {
+    size_t measureSlabs; // measure slabs, whether handed out or not
+    size_t taintedTrunkSlabs;
+    size_t pools; // measurePool and taintedTrunkPool
+    size_t measureContainers; // the scratch stacks of frontiers and candidates
+    size_t persistentSets; // the slab of cached frontiers
+    size_t cacheMaps; // buckets and nodes of the cache maps
+    size_t docs; // docs and its parallel arrays
+    size_t strings;
+    size_t total;
+};
+
+MemoryReport memoryReport() {
+    MemoryReport report;
+    report.measureSlabs = measureSlabs.size() * MEASURE_SLAB_SIZE * sizeof(Measure) + measureSlabs.capacity() * sizeof(Measure*);
+    report.taintedTrunkSlabs = taintedTrunkSlabs.size() * TAINTED_TRUNK_SLAB_SIZE * sizeof(TaintedTrunk) + taintedTrunkSlabs.capacity() * sizeof(TaintedTrunk*);
+    report.pools = measurePool.capacity() * sizeof(MeasureRef) + taintedTrunkPool.capacity() * sizeof(TaintedTrunk*);
+
+    report.measureContainers = scratchFrontiers.capacity * sizeof(MeasureRef)
+        + scratchCandidates.capacity * sizeof(MeasureCandidate);
+
+    report.persistentSets = cachedFrontiers.capacity() * sizeof(MeasureRef);
+    // unordered_map nodes hold the value and a next pointer, the hash of an integer key is not stored
+    size_t nodeSize = sizeof(pair<const uint64_t, DocCache>) + sizeof(void*);
+    report.cacheMaps = (cache.capacity() + spareCacheMaps.capacity()) * sizeof(CacheMap) + recycledCacheNodeBytes;
+    for (auto& docCache : cache) {
+        report.cacheMaps += docCache.bucket_count() * sizeof(void*) + docCache.size() * nodeSize;
+    }
+    for (auto& docCache : spareCacheMaps) {
+        report.cacheMaps += docCache.bucket_count() * sizeof(void*);
+    }
+
+    report.docs = docs.capacity() * sizeof(Doc) + cacheWeight.capacity() * sizeof(int) + greedyWidths.capacity() * sizeof(GreedyWidths);
+    report.strings = strings.capacity() * sizeof(string);
+    for (const string& s : strings) {
+        // short strings live inside the string object itself
+        if (s.capacity() > sizeof(string) - 1) report.strings += s.capacity() + 1;
+    }
+
+    report.total = report.measureSlabs + report.taintedTrunkSlabs + report.pools + report.measureContainers
+        + report.persistentSets + report.cacheMaps + report.docs + report.strings;
+    return report;
+}
+
 struct Output {
     string layout;
     Cost cost;
     bool isTainted;
+    uint64_t lineCount;
+    uint32_t last; // column the layout ends on
+};
+
+// wall time in seconds spent in each phase of the last print
+struct PrintPhases {
+    double resolve;
+    double expand;
+    double render;
+};
+PrintPhases printPhases;
+
+double secondsBetween(chrono::steady_clock::time_point start, chrono::steady_clock::time_point stop) {
+    return chrono::duration<double>(stop - start).count();
+}
+
+enum class PrintEngine {
+    OPTIMAL, // the layout with the lowest cost
+    GREEDY, // Wadler style, every choice is made once by looking ahead up to pageWidth
+};
+
+struct GreedyItem {
+    uint32_t docId;
+    uint32_t indent;
+    bool flatten;
+    // a CHOICE whose alternatives are concatenations of the same left document, printed already,
+    // so only their right documents are left to choose from
+    bool shared;
 };
 
-Output print(uint32_t docId) {
-    // Measure* arena [MEASURE_ARENA_SIZE];
-    MeasureContainer arena = borrowMeasureContainer();
-    MeasureSet ms = resolveCached(docId, 0, 0, false, arena);
-    Measure* measure;
+// Both alternatives start with the same document, like the lines fill-sep has filled so far.
+bool greedySharedPrefix(Doc* doc) {
+    Doc* left = &docs[doc->choice.leftDoc];
+    Doc* right = &docs[doc->choice.rightDoc];
+    return left->type == DocType::CONCAT && right->type == DocType::CONCAT && left->concat.leftDoc == right->concat.leftDoc;
+}
+
+// The two alternatives of a CHOICE item, without the prefix when it is shared.
+void greedyAlternatives(GreedyItem item, uint32_t& left, uint32_t& right) {
+    Doc* doc = &docs[item.docId];
+    left = doc->choice.leftDoc;
+    right = doc->choice.rightDoc;
+    if (item.shared) {
+        left = docs[left].concat.rightDoc;
+        right = docs[right].concat.rightDoc;
+    }
+}
+
+GreedyWidth greedyItemWidth(GreedyItem item, bool earliestBreak) {
+    if (item.shared) {
+        uint32_t left, right;
+        greedyAlternatives(item, left, right);
+        if (!earliestBreak) return greedyItemWidth({greedyPreferred(left, right), item.indent, item.flatten, false}, false);
+        return greedyEarliestBreak(greedyItemWidth({left, item.indent, item.flatten, false}, true), greedyItemWidth({right, item.indent, item.flatten, false}, true));
+    }
+    GreedyWidths widths = greedyWidths[item.docId];
+    if (item.flatten) return {widths.flat, false};
+    return earliestBreak ? widths.earliestBreak : widths.preferred;
+}
+
+// Whether next followed by the rest of the stack stays within pageWidth until its first newline.
+// Like Wadler's fits, next takes its preferred alternatives, while the choices still on the stack are assumed to break
+// as early as they can, which is what printGreedy does with them when the line gets too long.
+// Every item is stepped over with the widths computed when its document was created.
+bool greedyFits(GreedyItem next, const vector<GreedyItem>& rest, uint32_t col) {
+    GreedyWidth width = greedyItemWidth(next, false);
+    col += width.width;
+    if (col > pageWidth) return false;
+    if (width.breaks) return true;
+    for (size_t restIndex = rest.size(); restIndex > 0; restIndex--) {
+        width = greedyItemWidth(rest[restIndex - 1], true);
+        col += width.width;
+        if (col > pageWidth) return false;
+        if (width.breaks) return true;
+    }
+    return true;
+}
+
+// Prints in a single pass without measures or caches, the cost is computed like the optimal engine does,
+// so the two can be compared. The result is never tainted.
+// A choice between alternatives that start with the same document prints that document before choosing,
+// so the left nested choices of fill-sep are decided word by word like Wadler's fill.
+// Every document is visited once and every lookahead stops at the first item that breaks or overflows.
+Output printGreedy(uint32_t docId, uint32_t col) {
+    TRACE_EVENT(TraceScope traceScope("printGreedy", docId));
+    auto start = chrono::steady_clock::now();
+    vector<GreedyItem> stack = {{docId, 0, false, false}};
+    stringbuf buf;
+    Cost cost = {0, 0};
+    uint64_t newlines = 0;
+    while (!stack.empty()) {
+        GreedyItem item = stack.back();
+        stack.pop_back();
+        Doc* doc = &docs[item.docId];
+        switch (doc->type) {
+            case DocType::TEXT: {
+                auto str = &strings[doc->text.stringRef];
+                buf.sputn(str->c_str(), str->length());
+                newlines += count(str->begin(), str->end(), '\n');
+                cost = costAdd(cost, costText(col, doc->text.stringLength));
+                col += doc->text.stringLength;
+                break;
+            }
+            case DocType::NEWLINE:
+                if (item.flatten) {
+                    buf.sputn(" ", 1);
+                    cost = costAdd(cost, costText(col, 1));
+                    col += 1;
+                } else {
+                    putNewline(buf, item.indent);
+                    cost = costAdd(cost, costNl());
+                    col = item.indent;
+                    newlines++;
+                }
+                break;
+            case DocType::CONCAT:
+                stack.push_back({doc->concat.rightDoc, item.indent, item.flatten, false});
+                stack.push_back({doc->concat.leftDoc, item.indent, item.flatten, false});
+                break;
+            case DocType::CHOICE: {
+                if (!item.shared && greedySharedPrefix(doc)) {
+                    stack.push_back({item.docId, item.indent, item.flatten, true});
+                    stack.push_back({docs[doc->choice.leftDoc].concat.leftDoc, item.indent, item.flatten, false});
+                    break;
+                }
+                uint32_t left, right;
+                greedyAlternatives(item, left, right);
+                uint32_t preferred = greedyPreferred(left, right);
+                GreedyItem preferredItem = {preferred, item.indent, item.flatten, false};
+                stack.push_back(greedyFits(preferredItem, stack, col) ? preferredItem : GreedyItem{preferred == left ? right : left, item.indent, item.flatten, false});
+                break;
+            }
+            case DocType::NEST:
+                stack.push_back({doc->nest.nestedDoc, item.indent + doc->nest.indent, item.flatten, false});
+                break;
+            case DocType::ALIGN:
+                stack.push_back({doc->align.alignDoc, col, item.flatten, false});
+                break;
+            case DocType::FLATTEN:
+                stack.push_back({doc->flatten.flattenDoc, item.indent, true, false});
+                break;
+        }
+    }
+    Output output = {buf.str(), cost, false, newlines + 1, col};
+    printPhases = {0, 0, secondsBetween(start, chrono::steady_clock::now())}; // choosing and rendering are one pass
+    return output;
+}
+
+// col is the column the document starts on, when it continues a layout that was already printed
+Output print(uint32_t docId, PrintEngine engine = PrintEngine::OPTIMAL, uint32_t col = 0) {
+    if (engine == PrintEngine::GREEDY) return printGreedy(docId, col);
+    TRACE_EVENT(TraceScope traceScope("print", docId));
+    auto start = chrono::steady_clock::now();
+    uint32_t mark = scratchMark();
+    MeasureSet ms = resolveCached(docId, col, 0, false);
+    auto resolved = chrono::steady_clock::now();
+    MeasureRef measure;
     bool isTainted = ms.type == MeasureSetType::TAINTED;
     if (isTainted) {
+        TRACE_EVENT(TraceScope expandScope("expandTainted", docId));
         measure = expandTainted(ms.tainted.trunk);
     } else {
-        measure = (*ms.set.sets)[0];
+        measure = frontierData(ms.set)[0];
     }
+    scratchRelease(mark);
+    auto expanded = chrono::steady_clock::now();
     stringbuf buf;
-    renderChoiceLess(measure, buf);
-    return {buf.str(), measure->cost, isTainted};
+    uint64_t newlines = 0;
+    renderChoiceLess(measure, buf, newlines);
+    Output output = {buf.str(), measureCost(measureAt(measure)), isTainted, newlines + 1, measureLast(measureAt(measure))};
+    #if COMPACT_MEASURES
+    // the cost in the measure may have saturated
+    uint32_t end = col;
+    output.cost = layoutCost(measure, end);
+    #endif
+    auto rendered = chrono::steady_clock::now();
+    printPhases = {secondsBetween(start, resolved), secondsBetween(resolved, expanded), secondsBetween(expanded, rendered)};
+    return output;
+}
+
+#define NO_CHUNK UINT32_MAX
+
+struct StreamOutput {
+    Cost cost;
+    bool isTainted; // some chunk was tainted
+    uint64_t lineCount;
+    size_t chunks;
+    size_t maxChunkDocs;
+    bool costSaturated; // some chunk saturated a cost, only with COMPACT_MEASURES
+};
+
+// Prints a document made of consecutive chunks, e.g. the elements of a long array separated by hard newlines.
+// buildChunk(i) creates the documents of chunk i and returns its root, or NO_CHUNK after the last chunk.
+// Each chunk is printed where the previous one ended, handed to emit, and then dropped together with everything
+// print computed for it, so memory is bounded by the largest chunk instead of the whole document.
+// Choices are optimal within a chunk, a chunk that was emitted is never revisited.
+template <typename BuildChunk, typename Emit>
+StreamOutput printStream(BuildChunk buildChunk, Emit emit, PrintEngine engine = PrintEngine::OPTIMAL) {
+    StreamOutput stream = {{0, 0}, false, 1, 0, 0, false};
+    uint32_t col = 0;
+    DocMark mark = docMark();
+    while (true) {
+        uint32_t docId = buildChunk(stream.chunks);
+        if (docId == NO_CHUNK) break;
+        stream.maxChunkDocs = max(stream.maxChunkDocs, docs.size() - mark.docs);
+        Output output = print(docId, engine, col);
+        emit(output.layout);
+        stream.cost = costAdd(stream.cost, output.cost);
+        stream.isTainted = stream.isTainted || output.isTainted;
+        stream.lineCount += output.lineCount - 1;
+        stream.chunks++;
+        col = output.last;
+        #if COMPACT_MEASURES
+        // dropping the chunk resets the print state, which clears costSaturated
+        stream.costSaturated = stream.costSaturated || costSaturated;
+        #endif
+        dropDocsSince(mark);
+    }
+    return stream;
 }
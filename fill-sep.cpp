@@ -1,4 +1,5 @@
 #include "benchmark.h"
+#include "generators.h"
 #include <iostream>
 #include <fstream> 
 
@@ -14,24 +15,33 @@ uint32_t fillSep (const std::vector<string>& xs) {
 }
 
 
-int main(int argc, char *argv[]) {
-    Config cfg = parseArgs(argc, argv);
+// fillSep creates 10 documents and 3 strings per word, a third of the words get a cache id,
+// and printing takes about 16 measures per word.
+CapacityHint estimateFillSepCapacity(size_t words) {
+    return {10 * words, 3 * words + 1, words / 3 + 1, 16 * words, 0};
+}
 
-    const char* envPath = std::getenv("BENCHDATA");
-    std::string basePath = envPath != nullptr ? envPath : "../data";
-    std::string fullPath = basePath + "/words";
-    
-    ifstream wordFile(fullPath);
+uint32_t build(const Config& cfg) {
+    auto parseStart = std::chrono::steady_clock::now();
     std::vector<string> xs ={};
-    int i = cfg.size;
-    
-    std::string line;
-    while (getline (wordFile, line) && i-- > 0) {
-        xs.push_back(line);
+    if (cfg.generate) {
+        xs = generateWords(cfg.size, cfg.seed);
+    } else {
+        ifstream wordFile = openBenchData("words");
+        int i = cfg.size;
+        
+        std::string line;
+        while (getline (wordFile, line) && i-- > 0) {
+            xs.push_back(line);
+        }
     }
 
-    uint32_t parent = fillSep(xs);
-    
-    runBenchmark ("fill-sep", cfg, parent);
-    return 0;
+    frontEndPhases.parse = secondsSince(parseStart);
+    if (cfg.reserve) reserveCapacity(estimateFillSepCapacity(xs.size()));
+
+    return fillSep(xs);
+}
+
+int main(int argc, char *argv[]) {
+    return benchmarkMain("fill-sep", argc, argv, build);
 }
@@ -8,10 +8,10 @@ uint32_t pp (uint64_t n) {
     }
 }
 
+uint32_t build(const Config& cfg) {
+    return pp(cfg.size);
+}
+
 int main(int argc, char *argv[]) {
-    Config cfg = parseArgs(argc, argv);
-    
-    uint32_t parent = pp(cfg.size);
-    
-    runBenchmark ("flatten", cfg, parent);
+    return benchmarkMain("flatten", argc, argv, build);
 }
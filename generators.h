@@ -0,0 +1,112 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "nlohmann/json.hpp"
+
+// Deterministic stand-ins for the files under $BENCHDATA, so benchmarks can run offline at any size.
+// Everything is derived from splitmix64 instead of <random>, whose distributions differ between standard libraries.
+struct Rng {
+    uint64_t state;
+
+    explicit Rng(uint64_t seed) : state(seed) {}
+
+    uint64_t next() {
+        uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+
+    // uniform in [lo, hi]
+    uint64_t between(uint64_t lo, uint64_t hi) {
+        return lo + next() % (hi - lo + 1);
+    }
+
+    // uniform in [0, 1)
+    double unit() {
+        return (next() >> 11) * (1.0 / 9007199254740992.0);
+    }
+};
+
+std::string generateWord(Rng& rng, size_t minLength, size_t maxLength) {
+    size_t length = rng.between(minLength, maxLength);
+    std::string word(length, 'a');
+    for (size_t i = 0; i < length; i++) {
+        word[i] = 'a' + rng.between(0, 25);
+    }
+    return word;
+}
+
+// replaces $BENCHDATA/words
+std::vector<std::string> generateWords(size_t count, uint64_t seed) {
+    Rng rng(seed);
+    std::vector<std::string> words;
+    words.reserve(count);
+    for (size_t i = 0; i < count; i++) {
+        words.push_back(generateWord(rng, 1, 12));
+    }
+    return words;
+}
+
+nlohmann::json generateJsonValue(Rng& rng, size_t& budget, uint32_t depth) {
+    double roll = rng.unit();
+    if (budget == 0 || depth >= 6 || roll < 0.35) {
+        if (budget > 0) budget--;
+        switch (rng.between(0, 5)) {
+            case 0: return nullptr;
+            case 1: return rng.between(0, 1) == 1;
+            case 2: return (int64_t) rng.between(0, 100000);
+            case 3: return rng.unit() * 1000;
+            default: return generateWord(rng, 0, 16);
+        }
+    }
+    if (roll < 0.65) {
+        nlohmann::json array = nlohmann::json::array();
+        size_t length = rng.between(0, 8);
+        for (size_t i = 0; i < length && budget > 0; i++) {
+            array.push_back(generateJsonValue(rng, budget, depth + 1));
+        }
+        return array;
+    }
+    nlohmann::json object = nlohmann::json::object();
+    size_t length = rng.between(0, 8);
+    for (size_t i = 0; i < length && budget > 0; i++) {
+        object[generateWord(rng, 1, 10)] = generateJsonValue(rng, budget, depth + 1);
+    }
+    return object;
+}
+
+// replaces $BENCHDATA/1k.json and 10k.json, a top level array with roughly `leaves` scalar values
+nlohmann::json generateJson(size_t leaves, uint64_t seed) {
+    Rng rng(seed);
+    size_t budget = leaves;
+    nlohmann::json root = nlohmann::json::array();
+    while (budget > 0) {
+        root.push_back(generateJsonValue(rng, budget, 1));
+    }
+    return root;
+}
+
+nlohmann::json generateTreeNode(Rng& rng, size_t nodes) {
+    if (nodes <= 1) {
+        return generateWord(rng, 1, 8);
+    }
+    // split the remaining nodes between a random number of children
+    size_t remaining = nodes - 1;
+    size_t children = rng.between(1, std::min<size_t>(remaining, 6));
+    nlohmann::json list = nlohmann::json::array();
+    for (size_t i = 0; i < children; i++) {
+        size_t left = children - i - 1;
+        size_t share = left == 0 ? remaining : rng.between(1, remaining - left);
+        list.push_back(generateTreeNode(rng, share));
+        remaining -= share;
+    }
+    return list;
+}
+
+// replaces $BENCHDATA/random-tree-N.sexp, a tree of nested arrays with `nodes` nodes and strings as atoms
+nlohmann::json generateRandomTree(size_t nodes, uint64_t seed) {
+    Rng rng(seed);
+    return generateTreeNode(rng, std::max<size_t>(nodes, 1));
+}
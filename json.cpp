@@ -1,6 +1,7 @@
 #include <fstream>
 #include "benchmark.h"
 #include "nlohmann/json.hpp"
+#include "generators.h"
 
 using json = nlohmann::json;
 
@@ -75,23 +76,137 @@ uint32_t pp(const json json) {
 }
 
 
-int main(int argc, char *argv[])
-{
-    Config cfg = parseArgs(argc, argv);
-
-    const char* envPath = std::getenv("BENCHDATA");
-    
-    std::string basePath = envPath != nullptr ? envPath : "../data";
-    std::string fullPath = basePath + (cfg.size == 1 ? "/1k.json" : "/10k.json");
+// What pp builds and print uses for a JSON input of the given size, measured on 1k.json and 10k.json:
+// about a document per byte, a string per 3.5 bytes, a cache id per 17 bytes,
+// and 0.55 measures and 0.25 tainted trunks per byte at the default widths.
+CapacityHint estimateJsonCapacity(size_t bytes) {
+    return {bytes + bytes / 16, bytes / 3, bytes / 16, bytes * 55 / 100, bytes / 4};
+}
 
+// generated values average about 16 bytes of JSON each
+#define GENERATED_JSON_VALUE_BYTES 16
 
-    std::ifstream f(fullPath);
-    json data = json::parse(f);
+uint32_t build(const Config& cfg) {
+    auto parseStart = std::chrono::steady_clock::now();
+    json data;
+    size_t bytes;
+    if (cfg.generate) {
+        // --size counts thousands of values, like 1k.json and 10k.json
+        data = generateJson(cfg.size * 1000, cfg.seed);
+        bytes = cfg.size * 1000 * GENERATED_JSON_VALUE_BYTES;
+    } else {
+        std::ifstream f = openBenchData(cfg.size == 1 ? "1k.json" : "10k.json");
+        f.seekg(0, std::ios::end);
+        bytes = f.tellg();
+        f.seekg(0);
+        data = json::parse(f);
+    }
 
+    frontEndPhases.parse = secondsSince(parseStart);
     // auto v = convert(data);
+    if (cfg.reserve) reserveCapacity(estimateJsonCapacity(bytes));
 
-    
-    uint32_t parent = pp(data);
-    runBenchmark ("sexpr-random", cfg, parent);
+    return pp(data);
+}
+
+// The top level array printed --stream-chunk elements at a time, laid out the way encloseSep lays out an array
+// too wide for a single line: "[" and the first element, "\n," before every other element, and "]" at the end.
+// Reads the elements of a top level JSON array one at a time, so the input is never in memory as a whole.
+// It only finds where an element ends, skipping the commas inside strings and nested values, json::parse does the rest.
+struct JsonArrayReader {
+    std::istream& in;
+    bool started = false;
+    bool done = false;
+    std::string element;
 
+    explicit JsonArrayReader(std::istream& in) : in(in) {}
+
+    // false after the last element
+    bool next(json& value) {
+        if (!started) {
+            started = true;
+            in >> std::ws;
+            if (in.get() != '[') throw std::runtime_error("Expected a top level JSON array");
+            in >> std::ws;
+            if (in.peek() == ']') done = true;
+        }
+        if (done) return false;
+        element.clear();
+        int depth = 0;
+        bool inString = false;
+        while (true) {
+            int c = in.get();
+            if (c == EOF) throw std::runtime_error("Unterminated top level JSON array");
+            if (inString) {
+                element.push_back((char) c);
+                if (c == '\\') element.push_back((char) in.get());
+                else if (c == '"') inString = false;
+                continue;
+            }
+            if (depth == 0 && (c == ',' || c == ']')) {
+                done = c == ']';
+                break;
+            }
+            if (c == '"') inString = true;
+            else if (c == '[' || c == '{') depth++;
+            else if (c == ']' || c == '}') depth--;
+            element.push_back((char) c);
+        }
+        value = json::parse(element);
+        return true;
+    }
+};
+
+void streamJson(const Config& cfg) {
+    // parse counts the time spent reading and parsing elements, which happens while the chunks are built
+    std::ifstream f;
+    if (!cfg.generate) f = openBenchData(cfg.size == 1 ? "1k.json" : "10k.json");
+    JsonArrayReader reader(f);
+
+    // generated elements are made on demand, so the input never has to be in memory either
+    Rng rng(cfg.seed);
+    size_t budget = cfg.size * 1000;
+    auto nextElement = [&](json& element) {
+        auto parseStart = std::chrono::steady_clock::now();
+        bool found;
+        if (cfg.generate) {
+            found = budget > 0;
+            if (found) element = generateJsonValue(rng, budget, 1);
+        } else {
+            found = reader.next(element);
+        }
+        frontEndPhases.parse += secondsSince(parseStart);
+        return found;
+    };
+
+    json pending;
+    bool hasPending = nextElement(pending);
+    bool closed = false;
+    size_t elements = 0;
+    runStreamBenchmark("json", cfg, [&](size_t chunk) {
+        if (closed) return NO_CHUNK;
+        uint32_t doc = createText(chunk == 0 ? "[" : "");
+        for (size_t i = 0; i < cfg.streamChunk && hasPending; i++) {
+            uint32_t element = pp(pending);
+            if (elements > 0) element = createConcat(createConcat(createNewline(), createText(",")), element);
+            doc = createConcat(doc, element);
+            elements++;
+            hasPending = nextElement(pending);
+        }
+        if (!hasPending) {
+            doc = createConcat(doc, createText("]"));
+            closed = true;
+        }
+        return doc;
+    });
+}
+
+int main(int argc, char *argv[])
+{
+    Config cfg = parseArgs(argc, argv);
+    if (cfg.streamChunk > 0) {
+        streamJson(cfg);
+        return 0;
+    }
+    return benchmarkMain("json", argc, argv, build);
 }
@@ -0,0 +1,118 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+// Streaming MD5 (RFC 1321), so benchmarks can hash their output in process
+// instead of going through a temporary file and md5sum.
+struct Md5 {
+    uint32_t state[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+    uint64_t length = 0; // total bytes consumed
+    unsigned char block[64];
+    size_t blockSize = 0;
+
+    void update(const char* data, size_t size) {
+        const unsigned char* input = (const unsigned char*) data;
+        length += size;
+        if (blockSize > 0) {
+            size_t take = std::min(size, 64 - blockSize);
+            memcpy(block + blockSize, input, take);
+            blockSize += take;
+            input += take;
+            size -= take;
+            if (blockSize < 64) return;
+            transform(block);
+            blockSize = 0;
+        }
+        while (size >= 64) {
+            transform(input);
+            input += 64;
+            size -= 64;
+        }
+        memcpy(block, input, size);
+        blockSize = size;
+    }
+
+    void update(const std::string& s) {
+        update(s.data(), s.size());
+    }
+
+    // finishes the hash, the hasher must not be updated afterwards
+    std::string hexDigest() {
+        uint64_t bitLength = length * 8;
+        unsigned char padding[64] = {0x80};
+        size_t padSize = blockSize < 56 ? 56 - blockSize : 120 - blockSize;
+        update((const char*) padding, padSize);
+        unsigned char lengthBytes[8];
+        for (int i = 0; i < 8; i++) lengthBytes[i] = (unsigned char) (bitLength >> (8 * i));
+        update((const char*) lengthBytes, 8);
+
+        static const char* hex = "0123456789abcdef";
+        std::string result(32, '0');
+        for (int i = 0; i < 16; i++) {
+            unsigned char byte = (unsigned char) (state[i / 4] >> (8 * (i % 4)));
+            result[2 * i] = hex[byte >> 4];
+            result[2 * i + 1] = hex[byte & 0xf];
+        }
+        return result;
+    }
+
+private:
+    static uint32_t rotl(uint32_t x, int c) {
+        return (x << c) | (x >> (32 - c));
+    }
+
+    void transform(const unsigned char* chunk) {
+        static const uint32_t K[64] = {
+            0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+            0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+            0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+            0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+            0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+            0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+            0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+            0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391};
+        static const int S[64] = {
+            7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+            5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20,
+            4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+            6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21};
+
+        uint32_t M[16];
+        for (int i = 0; i < 16; i++) {
+            M[i] = (uint32_t) chunk[4 * i]
+                | ((uint32_t) chunk[4 * i + 1] << 8)
+                | ((uint32_t) chunk[4 * i + 2] << 16)
+                | ((uint32_t) chunk[4 * i + 3] << 24);
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        for (int i = 0; i < 64; i++) {
+            uint32_t f;
+            int g;
+            if (i < 16) {
+                f = (b & c) | (~b & d);
+                g = i;
+            } else if (i < 32) {
+                f = (d & b) | (~d & c);
+                g = (5 * i + 1) % 16;
+            } else if (i < 48) {
+                f = b ^ c ^ d;
+                g = (3 * i + 5) % 16;
+            } else {
+                f = c ^ (b | ~d);
+                g = (7 * i) % 16;
+            }
+            f = f + a + K[i] + M[g];
+            a = d;
+            d = c;
+            c = b;
+            b = b + rotl(f, S[i]);
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+    }
+};
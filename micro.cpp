@@ -0,0 +1,235 @@
+#include <functional>
+#include <memory>
+#include "benchmark.h"
+
+// Micro-benchmarks for the inner kernels of the engine, run on synthetic frontiers and caches of --size elements,
+// so changes to the hot paths can be measured without the noise of a full document.
+// --kernel <name> runs a single kernel, --iterations and --warmup work like for the other programs.
+
+// A frontier of `size` text measures, sorted like the engine sorts them: last descending, cost ascending.
+// offset shifts last, so two frontiers with different offsets interleave instead of dominating each other.
+// The frontier is appended to the cached frontiers, so it lives until the print state is reset.
+MeasureSetValue syntheticFrontier(size_t size, uint16_t offset) {
+    MeasureSetValue frontier = {(uint32_t) cachedFrontiers.size() | CACHED_FRONTIER, (uint32_t) size};
+    for (size_t i = 0; i < size; i++) {
+        MeasureRef m = allocateMeasure();
+        setMeasure(measureAt(m), MeasureType::TEXT, {0, i}, (uint16_t) (2 * (size - i) + offset));
+        measureAt(m)->text.stringRef = SPACE_STRING_REF;
+        cachedFrontiers.push_back(m);
+    }
+    return frontier;
+}
+
+// Mark a document as cacheable regardless of its cache weight.
+void forceCacheable(uint32_t docId) {
+    if (docs[docId].cache_id == 0) {
+        docs[docId].cache_id = cache.size();
+        cache.push_back({});
+    }
+}
+
+// A document whose frontier has `size` measures at every column: alternative i has i newlines followed by a text of size - i characters.
+uint32_t frontierDoc(size_t size) {
+    uint32_t doc = NO_GC;
+    for (size_t i = 0; i < size; i++) {
+        uint32_t alternative = createText(string(size - i, 'x'));
+        for (size_t j = 0; j < i; j++) {
+            alternative = createConcat(createNewline(), alternative);
+        }
+        doc = doc == NO_GC ? alternative : createChoice(alternative, doc);
+    }
+    forceCacheable(doc);
+    return doc;
+}
+
+struct KernelRun {
+    size_t ops; // operations per iteration, durations are reported per operation
+    std::function<void()> setup; // untimed, runs before every iteration
+    std::function<void()> body;
+};
+
+KernelRun mergeListKernel(size_t size) {
+    size_t reps = std::max<size_t>(1, 1000000 / size);
+    MeasureSetValue left = syntheticFrontier(size, 0);
+    MeasureSetValue right = syntheticFrontier(size, 1);
+    return {reps * 2 * size, [] {}, [=] {
+        for (size_t r = 0; r < reps; r++) {
+            uint32_t mark = scratchMark();
+            mergeList(left, right);
+            scratchRelease(mark);
+        }
+    }};
+}
+
+KernelRun processConcatKernel(size_t size) {
+    uint32_t right = frontierDoc(size);
+    size_t reps = std::max<size_t>(1, 1000000 / (size * size));
+    // shared by the setup and the timed lambda, which outlive this function
+    auto left = std::make_shared<MeasureSetValue>();
+    return {reps * size * size, [=] {
+        resetPrintState();
+        *left = syntheticFrontier(size, 0);
+        // warm the cache of the right document for every column the left frontier ends on
+        for (uint32_t i = 0; i < left->length; i++) {
+            uint32_t mark = scratchMark();
+            resolveCached(right, measureLast(measureAt(frontierData(*left)[i])), 0, false);
+            scratchRelease(mark);
+        }
+    }, [=] {
+        MeasureSet leftSet;
+        leftSet.type = MeasureSetType::SET;
+        leftSet.set = *left;
+        for (size_t r = 0; r < reps; r++) {
+            uint32_t mark = scratchMark();
+            processConcat(leftSet, right, 0, 0, false);
+            scratchRelease(mark);
+        }
+    }};
+}
+
+KernelRun resolveCachedKernel(size_t size) {
+    uint32_t doc = createText("x");
+    forceCacheable(doc);
+    size_t lookups = 1000000;
+    return {lookups, [=] {
+        resetPrintState();
+        for (size_t col = 0; col < size; col++) {
+            resolveCached(doc, col, 0, false);
+        }
+    }, [=] {
+        for (size_t i = 0; i < lookups; i++) {
+            resolveCached(doc, i % size, 0, false);
+        }
+    }};
+}
+
+KernelRun allocateMeasureKernel(size_t size) {
+    size_t count = size * 1000;
+    return {count, [] { resetPrintState(); }, [=] {
+        for (size_t i = 0; i < count; i++) {
+            MeasureRef m = allocateMeasure();
+            setMeasure(measureAt(m), MeasureType::NEWLINE, {0, 1}, 0);
+        }
+    }};
+}
+
+// a balanced tree of concat measures over `leaves` alternating text and newline measures
+MeasureRef syntheticLayout(size_t leaves, size_t& counter) {
+    if (leaves == 1) {
+        MeasureRef ref = allocateMeasure();
+        Measure* m = measureAt(ref);
+        if (counter++ % 8 == 7) {
+            setMeasure(m, MeasureType::NEWLINE, {0, 1}, 4);
+            m->newline.indent = 4;
+        } else {
+            setMeasure(m, MeasureType::TEXT, {0, 0}, 1);
+            m->text.stringRef = SPACE_STRING_REF;
+        }
+        return ref;
+    }
+    MeasureRef left = syntheticLayout(leaves / 2, counter);
+    MeasureRef right = syntheticLayout(leaves - leaves / 2, counter);
+    return measureConcat(left, right);
+}
+
+KernelRun renderChoiceLessKernel(size_t size) {
+    size_t leaves = size * 1000;
+    size_t counter = 0;
+    MeasureRef layout = syntheticLayout(leaves, counter);
+    return {2 * leaves - 1, [] {}, [=] {
+        stringbuf buf;
+        uint64_t newlines = 0;
+        renderChoiceLess(layout, buf, newlines);
+    }};
+}
+
+// fill-sep's document of `size` thousand words, the left nested choices greedy has to decide word by word
+KernelRun printGreedyFillSepKernel(size_t size) {
+    size_t words = size * 1000;
+    uint32_t acc = createText("x");
+    for (size_t i = 1; i < words; i++) {
+        std::string word((i * 7) % 12 + 1, 'x');
+        uint32_t align = createConcat(acc, createConcat(createText(" "), createAlign(createText(word))));
+        uint32_t newline = createConcat(acc, createConcat(createNewline(), createText(word)));
+        acc = createChoice(align, newline);
+    }
+    // ns-per-op stays flat across sizes as long as greedy is linear
+    return {words, [] {}, [=] {
+        print(acc, PrintEngine::GREEDY);
+    }};
+}
+
+// `size` thousand right nested pairs of a text and a newline ending in a text wider than computationWidth, every
+// document above that text is choice free and tainted, so resolve must not walk the rest of the chain from each of them
+KernelRun resolveTaintedChoiceFreeKernel(size_t size) {
+    size_t pairs = size * 1000;
+    uint32_t doc = createText(std::string(200, 'x'));
+    for (size_t i = 0; i < pairs; i++) {
+        doc = createConcat(createText("x"), createConcat(createNewline(), doc));
+    }
+    // ns-per-op stays flat across sizes as long as resolve is linear
+    return {pairs, [] {
+        resetPrintState();
+    }, [=] {
+        // the default width instead of the one that keeps the other kernels untainted
+        uint32_t width = computationWidth;
+        computationWidth = 100;
+        print(doc);
+        computationWidth = width;
+    }};
+}
+
+struct Kernel {
+    std::string name;
+    KernelRun (*create)(size_t size);
+};
+
+int main(int argc, char *argv[]) {
+    Config cfg = parseArgs(argc, argv);
+    std::string only = "";
+    for (int i = 1; i + 1 < argc; i++) {
+        if (std::string(argv[i]) == "--kernel") only = argv[i + 1];
+    }
+    computationWidth = UINT16_MAX; // synthetic layouts should never be tainted
+    pageWidth = cfg.pageWidth;
+
+    std::vector<Kernel> kernels = {
+        {"mergeList", mergeListKernel},
+        {"processConcat", processConcatKernel},
+        {"resolveCached", resolveCachedKernel},
+        {"allocateMeasure", allocateMeasureKernel},
+        {"renderChoiceLess", renderChoiceLessKernel},
+        {"printGreedyFillSep", printGreedyFillSepKernel},
+        {"resolveTaintedChoiceFree", resolveTaintedChoiceFreeKernel},
+    };
+    bool first = true;
+    for (const Kernel& kernel : kernels) {
+        if (!only.empty() && only != kernel.name) continue;
+        KernelRun run = kernel.create(cfg.size);
+        std::vector<double> samples;
+        for (size_t i = 0; i < cfg.warmup + cfg.iterations; i++) {
+            run.setup();
+            auto start = std::chrono::steady_clock::now();
+            run.body();
+            auto stop = std::chrono::steady_clock::now();
+            std::chrono::duration<double, std::nano> duration = stop - start;
+            if (i >= cfg.warmup) samples.push_back(duration.count() / run.ops);
+        }
+        TimingStats stats = computeStats(samples);
+
+        Report report;
+        report.addString("target", "pretty-expressive-cpp");
+        report.addString("program", "micro");
+        report.addString("kernel", kernel.name);
+        report.add("size", cfg.size);
+        report.add("ops", run.ops);
+        report.add("iterations", cfg.iterations);
+        report.add("ns-per-op", stats.median);
+        report.add("p95", stats.p95);
+        report.add("stddev", stats.stddev);
+        writeReport(report, cfg, std::cout, first);
+        if (cfg.format == "sexp") std::cout << "\n";
+        first = false;
+    }
+    return 0;
+}
@@ -0,0 +1,89 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Hardware counters read through perf_event_open, to check where print spends its cycles.
+// Counters that the kernel or the CPU refuses (containers, VMs, perf_event_paranoid) are skipped, so this never fails.
+struct PerfCounter {
+    std::string name;
+    uint32_t type;
+    uint64_t config;
+    int fd;
+    double value; // scaled when the kernel multiplexed the counter
+};
+
+uint64_t hwCacheConfig(uint64_t cache, uint64_t op, uint64_t result) {
+    return cache | (op << 8) | (result << 16);
+}
+
+struct PerfCounters {
+    std::vector<PerfCounter> counters;
+
+    // returns false when not a single counter could be opened
+    bool open() {
+        std::vector<PerfCounter> wanted = {
+            {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, -1, 0},
+            {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, -1, 0},
+            {"cache-references", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES, -1, 0},
+            {"cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, -1, 0},
+            {"branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, -1, 0},
+            {"l1d-load-misses", PERF_TYPE_HW_CACHE, hwCacheConfig(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS), -1, 0},
+            {"dtlb-load-misses", PERF_TYPE_HW_CACHE, hwCacheConfig(PERF_COUNT_HW_CACHE_DTLB, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS), -1, 0},
+            {"page-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, -1, 0},
+        };
+        for (PerfCounter& counter : wanted) {
+            struct perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = counter.type;
+            attr.config = counter.config;
+            attr.disabled = 1;
+            attr.exclude_kernel = 1; // allowed with the default perf_event_paranoid
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            counter.fd = (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+            if (counter.fd >= 0) counters.push_back(counter);
+        }
+        return !counters.empty();
+    }
+
+    void start() {
+        for (PerfCounter& counter : counters) {
+            ioctl(counter.fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+
+    // stops counting, afterwards value holds the total over every start/stop interval so far
+    void stop() {
+        for (PerfCounter& counter : counters) {
+            ioctl(counter.fd, PERF_EVENT_IOC_DISABLE, 0);
+        }
+        for (PerfCounter& counter : counters) {
+            uint64_t data[3]; // value, time enabled, time running
+            if (read(counter.fd, data, sizeof(data)) == sizeof(data) && data[2] > 0) {
+                counter.value = data[0] * ((double) data[1] / data[2]);
+            }
+        }
+    }
+
+    // value of the named counter, or -1 when it is not available
+    double get(const std::string& name) {
+        for (PerfCounter& counter : counters) {
+            if (counter.name == name) return counter.value;
+        }
+        return -1;
+    }
+
+    void close() {
+        for (PerfCounter& counter : counters) {
+            ::close(counter.fd);
+        }
+        counters.clear();
+    }
+};
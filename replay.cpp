@@ -0,0 +1,269 @@
+#include "benchmark.h"
+#include "resolve-log.h"
+
+// Replays a log written with --resolve-log (by a program compiled with -DRESOLVE_LOG=1) without the front-end.
+//   ./replay.out <log> [--iterations N] [--cache-distance 1,3,7]
+// Reports the recorded request stream, times cache backends on it, simulates admission policies,
+// and prints the logged document again for every cache distance.
+
+// A request the engine looks up in the cache, keyed the way the engine keys it.
+struct CacheRequest {
+    uint32_t cacheId;
+    uint64_t key;
+    bool hit; // what the engine saw when the log was written
+    uint16_t measures;
+};
+
+std::vector<CacheRequest> cacheRequests(const std::vector<ResolveRecord>& records) {
+    std::vector<CacheRequest> requests;
+    for (const ResolveRecord& record : records) {
+        if (record.outcome == ResolveOutcome::UNCACHED) continue;
+        requests.push_back({docs[record.docId].cache_id, cacheKey(record.col, record.indent, record.flatten),
+                            record.outcome == ResolveOutcome::HIT, record.measures});
+    }
+    return requests;
+}
+
+// Open addressing with linear probing over (cacheId, key), shared by every document.
+struct OpenAddressingCache {
+    struct Slot {
+        uint64_t key;
+        uint32_t cacheId; // UINT32_MAX marks an empty slot
+    };
+    std::vector<Slot> slots;
+    size_t used = 0;
+    int shift = 64 - 10; // slots.size() == 1 << (64 - shift)
+
+    OpenAddressingCache() : slots(1024, {0, UINT32_MAX}) {}
+
+    size_t slotFor(uint32_t cacheId, uint64_t key) {
+        uint64_t h = (key ^ ((uint64_t) cacheId << 40)) * 0x9e3779b97f4a7c15ULL;
+        size_t mask = slots.size() - 1;
+        size_t i = h >> shift; // the top bits depend on every bit of the key
+        while (slots[i].cacheId != UINT32_MAX && (slots[i].cacheId != cacheId || slots[i].key != key)) {
+            i = (i + 1) & mask;
+        }
+        return i;
+    }
+
+    // returns true when the key was already present
+    bool findOrInsert(uint32_t cacheId, uint64_t key) {
+        size_t i = slotFor(cacheId, key);
+        if (slots[i].cacheId != UINT32_MAX) return true;
+        slots[i] = {key, cacheId};
+        if (++used * 2 > slots.size()) grow();
+        return false;
+    }
+
+    void grow() {
+        std::vector<Slot> old = std::move(slots);
+        slots.assign(old.size() * 2, {0, UINT32_MAX});
+        shift--;
+        for (const Slot& slot : old) {
+            if (slot.cacheId != UINT32_MAX) slots[slotFor(slot.cacheId, slot.key)] = slot;
+        }
+    }
+};
+
+struct Backend {
+    std::string name;
+    size_t (*replay)(const std::vector<CacheRequest>& requests); // returns the number of hits
+};
+
+size_t replayUnorderedMap(const std::vector<CacheRequest>& requests) {
+    std::vector<std::unordered_map<uint64_t, DocCache>> maps(cache.size());
+    size_t hits = 0;
+    for (const CacheRequest& request : requests) {
+        auto& map = maps[request.cacheId];
+        if (map.find(request.key) != map.end()) {
+            hits++;
+        } else {
+            map.emplace(request.key, DocCache::Create(request.key, {}));
+        }
+    }
+    return hits;
+}
+
+size_t replaySortedVector(const std::vector<CacheRequest>& requests) {
+    std::vector<std::vector<DocCache>> arrays(cache.size());
+    size_t hits = 0;
+    for (const CacheRequest& request : requests) {
+        auto& arr = arrays[request.cacheId];
+        FoundOrIndex find = findCacheIndex(arr, request.key);
+        if (find.found) {
+            hits++;
+        } else {
+            arr.insert(arr.begin() + find.missingIndex, DocCache::Create(request.key, {}));
+        }
+    }
+    return hits;
+}
+
+size_t replayOpenAddressing(const std::vector<CacheRequest>& requests) {
+    OpenAddressingCache table;
+    size_t hits = 0;
+    for (const CacheRequest& request : requests) {
+        if (table.findOrInsert(request.cacheId, request.key)) hits++;
+    }
+    return hits;
+}
+
+// Which misses are stored in the cache.
+enum class Admission {ALWAYS, SECOND_MISS, MIN_MEASURES};
+
+struct AdmissionResult {
+    size_t hits;
+    size_t misses;
+    size_t entries;
+    uint64_t remeasured; // measures resolved again because an earlier miss was not admitted
+};
+
+// Approximation: a request that misses because it was not admitted would resolve its children again,
+// those extra requests are not in the log, so only the logged requests are counted.
+AdmissionResult simulateAdmission(const std::vector<CacheRequest>& requests, Admission admission) {
+    struct KeyState {
+        bool stored = false;
+        bool seen = false; // doorkeeper for SECOND_MISS
+        uint16_t measures = 0; // of the logged miss
+    };
+    std::vector<std::unordered_map<uint64_t, KeyState>> states(cache.size());
+    AdmissionResult result = {0, 0, 0, 0};
+    for (const CacheRequest& request : requests) {
+        KeyState& state = states[request.cacheId][request.key];
+        if (!request.hit) state.measures = request.measures;
+        if (state.stored) {
+            result.hits++;
+            continue;
+        }
+        result.misses++;
+        if (request.hit) result.remeasured += state.measures;
+        bool admit = admission == Admission::ALWAYS
+            || (admission == Admission::SECOND_MISS && state.seen)
+            || (admission == Admission::MIN_MEASURES && state.measures >= 2);
+        state.seen = true;
+        if (admit) {
+            state.stored = true;
+            result.entries++;
+        }
+    }
+    return result;
+}
+
+int main(int argc, char *argv[]) {
+    // --cache-distance is taken out before parseArgs sees the rest, so its value is not mistaken for the log
+    std::string distances = "";
+    std::vector<char*> rest = {argv[0]};
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--cache-distance" && i + 1 < argc) distances = argv[++i];
+        else rest.push_back(argv[i]);
+    }
+    Config cfg = parseArgs((int) rest.size(), rest.data());
+    if (cfg.positional.empty()) {
+        std::cerr << "Usage: " << argv[0] << " <resolve log> [--iterations N] [--cache-distance list]" << std::endl;
+        return 1;
+    }
+    std::string logPath = cfg.positional[0];
+
+    std::vector<ResolveRecord> records;
+    ResolveLogHeader header;
+    try {
+        header = readResolveLog(logPath, records);
+    } catch (const std::runtime_error& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    pageWidth = header.pageWidth;
+    computationWidth = header.computationWidth;
+    cacheDistance = header.cacheDistance;
+    recomputeCacheIds();
+
+    size_t counts[3] = {0, 0, 0};
+    for (const ResolveRecord& record : records) {
+        counts[(int) record.outcome]++;
+    }
+    Report summary;
+    summary.addString("target", "pretty-expressive-cpp");
+    summary.addString("program", "replay");
+    summary.add("docs", docs.size());
+    summary.add("cache-distance", header.cacheDistance);
+    summary.add("requests", records.size());
+    summary.add("uncached", counts[(int) ResolveOutcome::UNCACHED]);
+    summary.add("hits", counts[(int) ResolveOutcome::HIT]);
+    summary.add("misses", counts[(int) ResolveOutcome::MISS]);
+    writeReport(summary, cfg, std::cout);
+    if (cfg.format == "sexp") std::cout << "\n";
+
+    std::vector<CacheRequest> requests = cacheRequests(records);
+    std::vector<Backend> backends = {
+        {"unordered-map", replayUnorderedMap},
+        {"sorted-vector", replaySortedVector},
+        {"open-addressing", replayOpenAddressing},
+    };
+    bool first = true;
+    for (const Backend& backend : backends) {
+        std::vector<double> samples;
+        size_t hits = 0;
+        for (size_t i = 0; i < cfg.warmup + cfg.iterations; i++) {
+            auto start = std::chrono::steady_clock::now();
+            hits = backend.replay(requests);
+            if (i >= cfg.warmup) samples.push_back(secondsSince(start));
+        }
+        TimingStats stats = computeStats(samples);
+        Report report;
+        report.addString("backend", backend.name);
+        report.add("duration", stats.median);
+        report.add("ns-per-request", requests.empty() ? 0 : stats.median * 1e9 / requests.size());
+        report.add("hits", hits);
+        report.addBool("matches-log", hits == counts[(int) ResolveOutcome::HIT]);
+        writeReport(report, cfg, std::cout, first);
+        if (cfg.format == "sexp") std::cout << "\n";
+        first = false;
+    }
+
+    std::vector<std::pair<std::string, Admission>> admissions = {
+        {"always", Admission::ALWAYS},
+        {"second-miss", Admission::SECOND_MISS},
+        {"min-measures-2", Admission::MIN_MEASURES},
+    };
+    first = true;
+    for (const auto& [name, admission] : admissions) {
+        AdmissionResult result = simulateAdmission(requests, admission);
+        Report report;
+        report.addString("admission", name);
+        report.add("hits", result.hits);
+        report.add("misses", result.misses);
+        report.add("entries", result.entries);
+        report.add("remeasured", result.remeasured);
+        writeReport(report, cfg, std::cout, first);
+        if (cfg.format == "sexp") std::cout << "\n";
+        first = false;
+    }
+
+    std::vector<size_t> cacheDistances = distances.empty() ? std::vector<size_t>{header.cacheDistance} : parseSweepList(distances);
+    first = true;
+    for (size_t distance : cacheDistances) {
+        cacheDistance = distance;
+        std::vector<double> samples;
+        Output result;
+        for (size_t i = 0; i < cfg.warmup + cfg.iterations; i++) {
+            recomputeCacheIds();
+            auto start = std::chrono::steady_clock::now();
+            result = print(header.root);
+            if (i >= cfg.warmup) samples.push_back(secondsSince(start));
+        }
+        TimingStats stats = computeStats(samples);
+        Report report;
+        report.add("cache-distance", distance);
+        report.add("duration", stats.median);
+        report.add("cache-ids", cache.size());
+        report.add("cache-entries", cacheEntries());
+        report.add("lines", result.lineCount);
+        report.addBool("tainted?", result.isTainted);
+        report.addString("md5", md5Hash(result.layout));
+        writeReport(report, cfg, std::cout, first);
+        if (cfg.format == "sexp") std::cout << "\n";
+        first = false;
+    }
+    return 0;
+}
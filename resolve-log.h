@@ -0,0 +1,185 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Binary log of the requests resolveCached receives during a print, together with the document they were made on,
+// so cache policies can be evaluated offline with replay.cpp. Included by doc.h when compiled with -DRESOLVE_LOG=1.
+//
+// Layout, all integers little endian as written by the host:
+//   ResolveLogHeader
+//   docCount x ResolveLogDoc
+//   stringCount x (uint32_t length, length bytes)
+//   ResolveRecord until the end of the file
+// Hits and uncached requests are logged when they are made, misses once they are resolved, which is also when
+// the engine inserts them into the cache.
+
+#define RESOLVE_LOG_MAGIC 0x4c525850 // "PXRL"
+#define RESOLVE_LOG_VERSION 1
+
+enum class ResolveOutcome : uint8_t {UNCACHED, HIT, MISS};
+
+struct ResolveLogHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t cacheDistance;
+    uint32_t pageWidth;
+    uint32_t computationWidth;
+    uint32_t root;
+    uint32_t docCount;
+    uint32_t stringCount;
+};
+
+struct ResolveLogDoc {
+    uint8_t type; // DocType
+    uint8_t padding[3]; // written as zeros, so the same run writes the same bytes
+    uint32_t nlCount;
+    uint32_t a; // first field of the union, e.g. leftDoc or stringRef
+    uint32_t b; // second field of the union or 0
+};
+
+struct ResolveRecord {
+    uint32_t docId;
+    uint16_t col; // col and indent saturate, like Measure::last
+    uint16_t indent;
+    uint16_t measures; // size of the resolved set for misses, 0 when tainted
+    uint8_t flatten;
+    ResolveOutcome outcome;
+};
+
+// the file is these structs written as they are in memory
+static_assert(sizeof(ResolveLogHeader) == 32, "resolve log header layout");
+static_assert(sizeof(ResolveLogDoc) == 16, "resolve log doc layout");
+static_assert(sizeof(ResolveRecord) == 12, "resolve log record layout");
+
+struct ResolveLog {
+    FILE* file = nullptr;
+    std::vector<ResolveRecord> buffer;
+    bool enabled = false;
+    uint64_t records = 0;
+};
+ResolveLog resolveLog;
+
+uint16_t saturate16(uint64_t value) {
+    return value > UINT16_MAX ? UINT16_MAX : (uint16_t) value;
+}
+
+ResolveLogDoc resolveLogDoc(const Doc& doc) {
+    ResolveLogDoc out = {(uint8_t) doc.type, {0, 0, 0}, doc.nlCount, 0, 0};
+    switch (doc.type) {
+        case DocType::TEXT: out.a = doc.text.stringRef; out.b = doc.text.stringLength; break;
+        case DocType::NEWLINE: break;
+        case DocType::CONCAT: out.a = doc.concat.leftDoc; out.b = doc.concat.rightDoc; break;
+        case DocType::CHOICE: out.a = doc.choice.leftDoc; out.b = doc.choice.rightDoc; break;
+        case DocType::NEST: out.a = doc.nest.nestedDoc; out.b = doc.nest.indent; break;
+        case DocType::ALIGN: out.a = doc.align.alignDoc; break;
+        case DocType::FLATTEN: out.a = doc.flatten.flattenDoc; break;
+    }
+    return out;
+}
+
+Doc docFromResolveLog(const ResolveLogDoc& in) {
+    Doc doc;
+    doc.type = (DocType) in.type;
+    doc.nlCount = in.nlCount;
+    doc.cache_id = 0;
+    doc.choiceFree = false; // set by recomputeCacheIds once every document is loaded
+    switch (doc.type) {
+        case DocType::TEXT: doc.text = {in.a, in.b}; break;
+        case DocType::NEWLINE: break;
+        case DocType::CONCAT: doc.concat = {in.a, in.b}; break;
+        case DocType::CHOICE: doc.choice = {in.a, in.b}; break;
+        case DocType::NEST: doc.nest = {in.a, in.b}; break;
+        case DocType::ALIGN: doc.align = {in.a}; break;
+        case DocType::FLATTEN: doc.flatten = {in.a}; break;
+    }
+    return doc;
+}
+
+// Starts logging, writing the current documents and strings first. Returns false if the file can't be created.
+bool resolveLogStart(const std::string& path, uint32_t root) {
+    resolveLog.file = fopen(path.c_str(), "wb");
+    if (resolveLog.file == nullptr) return false;
+    ResolveLogHeader header = {RESOLVE_LOG_MAGIC, RESOLVE_LOG_VERSION, cacheDistance, pageWidth, computationWidth,
+                               root, (uint32_t) docs.size(), (uint32_t) strings.size()};
+    fwrite(&header, sizeof(header), 1, resolveLog.file);
+    for (const Doc& doc : docs) {
+        ResolveLogDoc out = resolveLogDoc(doc);
+        fwrite(&out, sizeof(out), 1, resolveLog.file);
+    }
+    for (const string& s : strings) {
+        uint32_t length = s.size();
+        fwrite(&length, sizeof(length), 1, resolveLog.file);
+        fwrite(s.data(), 1, length, resolveLog.file);
+    }
+    resolveLog.buffer.reserve(1 << 16);
+    resolveLog.records = 0;
+    resolveLog.enabled = true;
+    return true;
+}
+
+void resolveLogFlush() {
+    if (!resolveLog.buffer.empty()) {
+        fwrite(resolveLog.buffer.data(), sizeof(ResolveRecord), resolveLog.buffer.size(), resolveLog.file);
+        resolveLog.buffer.clear();
+    }
+}
+
+void resolveLogRecord(uint32_t docId, uint32_t col, uint32_t indent, bool flatten, ResolveOutcome outcome, size_t measures) {
+    if (!resolveLog.enabled) return;
+    resolveLog.buffer.push_back({docId, saturate16(col), saturate16(indent), saturate16(measures), (uint8_t) flatten, outcome});
+    resolveLog.records++;
+    if (resolveLog.buffer.size() == resolveLog.buffer.capacity()) resolveLogFlush();
+}
+
+void resolveLogStop() {
+    if (!resolveLog.enabled) return;
+    resolveLogFlush();
+    fclose(resolveLog.file);
+    resolveLog.file = nullptr;
+    resolveLog.enabled = false;
+}
+
+// Reads a log, replacing docs and strings with the logged ones. Throws on a malformed file.
+ResolveLogHeader readResolveLog(const std::string& path, std::vector<ResolveRecord>& records) {
+    FILE* file = fopen(path.c_str(), "rb");
+    if (file == nullptr) throw std::runtime_error("Failed to open resolve log: " + path);
+    ResolveLogHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != RESOLVE_LOG_MAGIC || header.version != RESOLVE_LOG_VERSION) {
+        fclose(file);
+        throw std::runtime_error("Not a resolve log: " + path);
+    }
+    docs.clear();
+    docs.reserve(header.docCount);
+    for (uint32_t i = 0; i < header.docCount; i++) {
+        ResolveLogDoc in;
+        if (fread(&in, sizeof(in), 1, file) != 1) {
+            fclose(file);
+            throw std::runtime_error("Truncated resolve log: " + path);
+        }
+        docs.push_back(docFromResolveLog(in));
+    }
+    strings.clear();
+    strings.reserve(header.stringCount);
+    for (uint32_t i = 0; i < header.stringCount; i++) {
+        uint32_t length;
+        if (fread(&length, sizeof(length), 1, file) != 1) {
+            fclose(file);
+            throw std::runtime_error("Truncated resolve log: " + path);
+        }
+        string s(length, ' ');
+        if (length > 0 && fread(&s[0], 1, length, file) != length) {
+            fclose(file);
+            throw std::runtime_error("Truncated resolve log: " + path);
+        }
+        strings.push_back(s);
+    }
+    ResolveRecord record;
+    while (fread(&record, sizeof(record), 1, file) == 1) {
+        records.push_back(record);
+    }
+    fclose(file);
+    return header;
+}
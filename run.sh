@@ -11,6 +11,8 @@ case "$exe" in
   json) exe="json" ;;  
   sexp_full) exe="sexpr-full" ;;
   sexp_random) exe="sexpr-random" ;;
+  micro) exe="micro" ;;
+  replay) exe="replay" ;;
 esac
 
 # Shift positional parameters to exclude the first argument
@@ -76,10 +76,14 @@ uint32_t pp(SExpr* expr) {
 }
 
 
+uint32_t build(const Config& cfg) {
+    auto parseStart = std::chrono::steady_clock::now();
+    auto [t,c] = testExpr(cfg.size, 0);
+    frontEndPhases.parse = secondsSince(parseStart);
+    return pp(t);
+}
+
 int main(int argc, char *argv[])
 {
-    Config cfg = parseArgs(argc, argv);
-    auto [t,c] = testExpr(cfg.size, 0);
-    uint32_t parent = pp(t);
-    runBenchmark ("sexpr-full",cfg, parent);
+    return benchmarkMain("sexpr-full", argc, argv, build);
 }
@@ -1,6 +1,7 @@
 #include <fstream>
 #include "benchmark.h"
 #include "nlohmann/json.hpp"
+#include "generators.h"
 
 using json = nlohmann::json;
 
@@ -88,22 +89,22 @@ uint32_t pp(SExpr* expr) {
     }
 }
 
-int main(int argc, char *argv[])
-{
-    Config cfg = parseArgs(argc, argv);
-
-    const char* envPath = std::getenv("BENCHDATA");
-    
-    std::string basePath = envPath != nullptr ? envPath : "../data";
-    std::string fullPath = basePath + "/random-tree-" + std::to_string(cfg.size) + ".sexp";
-
-
-    std::ifstream f(fullPath);
-    json data = json::parse(f);
+uint32_t build(const Config& cfg) {
+    auto parseStart = std::chrono::steady_clock::now();
+    json data;
+    if (cfg.generate) {
+        data = generateRandomTree(cfg.size, cfg.seed);
+    } else {
+        std::ifstream f = openBenchData("random-tree-" + std::to_string(cfg.size) + ".sexp");
+        data = json::parse(f);
+    }
     auto v = convert(data);
+    frontEndPhases.parse = secondsSince(parseStart);
 
-    
-    uint32_t parent = pp(v);
-    runBenchmark ("sexpr-random", cfg, parent);
+    return pp(v);
+}
 
+int main(int argc, char *argv[])
+{
+    return benchmarkMain("sexpr-random", argc, argv, build);
 }
@@ -0,0 +1,103 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <ostream>
+#include <vector>
+
+// Timeline of engine activity in the Chrome trace-event format (open it in Perfetto or chrome://tracing).
+// Compile with -DTRACE_EVENTS=1 to add the hooks to the engine, then call traceStart before printing.
+// Events go into a ring buffer allocated up front, once it is full the oldest events are overwritten.
+struct TraceEvent {
+    const char* name;
+    uint64_t startNs;
+    uint64_t durationNs;
+    uint32_t docId;
+    const char* argNames[2]; // nullptr when unused
+    uint64_t args[2];
+};
+
+struct TraceBuffer {
+    std::vector<TraceEvent> events;
+    uint64_t recorded = 0; // total ever recorded, recorded % capacity is the next slot
+    bool enabled = false;
+    uint64_t thresholdNs = 0; // resolveCached misses and processConcat calls shorter than this are not recorded
+    std::chrono::steady_clock::time_point origin;
+};
+TraceBuffer traceBuffer;
+
+void traceStart(size_t capacity, uint64_t thresholdNs) {
+    traceBuffer.events.assign(capacity > 0 ? capacity : 1, TraceEvent());
+    traceBuffer.recorded = 0;
+    traceBuffer.thresholdNs = thresholdNs;
+    traceBuffer.origin = std::chrono::steady_clock::now();
+    traceBuffer.enabled = true;
+}
+
+void traceStop() {
+    traceBuffer.enabled = false;
+}
+
+uint64_t traceNow() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - traceBuffer.origin).count();
+}
+
+void traceComplete(const char* name, uint64_t startNs, uint32_t docId,
+                   const char* arg0Name = nullptr, uint64_t arg0 = 0,
+                   const char* arg1Name = nullptr, uint64_t arg1 = 0) {
+    if (!traceBuffer.enabled) return;
+    TraceEvent& event = traceBuffer.events[traceBuffer.recorded % traceBuffer.events.size()];
+    event.name = name;
+    event.startNs = startNs;
+    event.durationNs = traceNow() - startNs;
+    event.docId = docId;
+    event.argNames[0] = arg0Name;
+    event.argNames[1] = arg1Name;
+    event.args[0] = arg0;
+    event.args[1] = arg1;
+    traceBuffer.recorded++;
+}
+
+// Records a complete event when it goes out of scope, for functions with several returns.
+// Scopes of frequently called functions pass filtered, so only the ones slower than the threshold are kept.
+struct TraceScope {
+    const char* name;
+    uint64_t startNs;
+    uint32_t docId;
+    bool filtered;
+    const char* argNames[2] = {nullptr, nullptr};
+    uint64_t args[2] = {0, 0};
+
+    TraceScope(const char* name, uint32_t docId, bool filtered = false) : name(name), startNs(traceNow()), docId(docId), filtered(filtered) {}
+
+    ~TraceScope() {
+        if (filtered && traceNow() - startNs < traceBuffer.thresholdNs) return;
+        traceComplete(name, startNs, docId, argNames[0], args[0], argNames[1], args[1]);
+    }
+};
+
+void writeChromeTrace(std::ostream& out) {
+    size_t capacity = traceBuffer.events.size();
+    uint64_t kept = traceBuffer.recorded < capacity ? traceBuffer.recorded : capacity;
+    uint64_t first = traceBuffer.recorded - kept;
+    // microseconds with nanosecond digits, the default precision would round long traces to tens of microseconds
+    std::ios::fmtflags flags = out.flags();
+    std::streamsize precision = out.precision();
+    out << std::fixed << std::setprecision(3);
+    out << "{\"displayTimeUnit\": \"ns\", \"otherData\": {\"dropped\": " << first << "}, \"traceEvents\": [\n";
+    for (uint64_t i = first; i < traceBuffer.recorded; i++) {
+        const TraceEvent& event = traceBuffer.events[i % capacity];
+        out << (i > first ? ",\n" : "")
+            << "{\"name\": \"" << event.name << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": 1"
+            << ", \"ts\": " << event.startNs / 1000.0
+            << ", \"dur\": " << event.durationNs / 1000.0
+            << ", \"args\": {\"doc\": " << event.docId;
+        for (int a = 0; a < 2; a++) {
+            if (event.argNames[a] != nullptr) out << ", \"" << event.argNames[a] << "\": " << event.args[a];
+        }
+        out << "}}";
+    }
+    out << "\n]}\n";
+    out.flags(flags);
+    out.precision(precision);
+}